@@ -0,0 +1,97 @@
+#include "arena.h"
+
+#include <stdint.h>
+
+TextArena::TextArena()
+  : chunks(NULL), at(inlineChunk), end(inlineChunk + INLINE_CHUNK_SIZE),
+  nextChunkSize(MIN_CHUNK_SIZE), bytesAllocated(0) {}
+
+TextArena::~TextArena() {
+  reset();
+}
+
+static char* alignUp(char* p, size_t alignment) {
+  uintptr_t address = reinterpret_cast<uintptr_t>(p);
+  return p + ((alignment - address % alignment) % alignment);
+}
+
+void* TextArena::allocate(size_t size, size_t alignment) {
+  char* p = alignUp(at, alignment);
+  if (p > end || size > (size_t)(end - p)) {
+    // Start a new chunk big enough for this allocation; the rest of the current one is abandoned.
+    size_t chunkSize = nextChunkSize;
+    while (chunkSize < size + alignment) {
+      chunkSize *= 2;
+    }
+    Chunk* chunk = static_cast<Chunk*>(::operator new(sizeof(Chunk) + chunkSize));
+    chunk->next = chunks;
+    chunks = chunk;
+    at = reinterpret_cast<char*>(chunk + 1);
+    end = at + chunkSize;
+    nextChunkSize = chunkSize * 2;
+    p = alignUp(at, alignment);
+  }
+  at = p + size;
+  bytesAllocated += size;
+  return p;
+}
+
+void TextArena::reset() {
+  while (chunks != NULL) {
+    Chunk* next = chunks->next;
+    ::operator delete(chunks);
+    chunks = next;
+  }
+  at = inlineChunk;
+  end = inlineChunk + INLINE_CHUNK_SIZE;
+  nextChunkSize = MIN_CHUNK_SIZE;
+  bytesAllocated = 0;
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void* TextLockedResource::allocate(size_t size, size_t alignment) {
+  if (upstream == NULL) {
+    return ::operator new(size);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  return upstream->allocate(size, alignment);
+}
+
+void TextLockedResource::deallocate(void* p, size_t size, size_t alignment) {
+  if (upstream == NULL) {
+    ::operator delete(p);
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  upstream->deallocate(p, size, alignment);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void* TextCountingResource::allocate(size_t size, size_t alignment) {
+  void* p = (upstream != NULL) ? upstream->allocate(size, alignment) : ::operator new(size);
+  ++numAllocations;
+  bytesAllocated += size;
+  liveBytes += size;
+  if (liveBytes > peakLiveBytes) {
+    peakLiveBytes = liveBytes;
+  }
+  return p;
+}
+
+void TextCountingResource::deallocate(void* p, size_t size, size_t alignment) {
+  liveBytes -= size;
+  if (upstream != NULL) {
+    upstream->deallocate(p, size, alignment);
+  } else {
+    ::operator delete(p);
+  }
+}
+
+void TextCountingResource::reset() {
+  numAllocations = 0;
+  bytesAllocated = 0;
+  liveBytes = 0;
+  peakLiveBytes = 0;
+}
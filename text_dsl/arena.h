@@ -0,0 +1,124 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <mutex>
+
+// Where the per-render state gets its memory from; the same interface as std::pmr::memory_resource,
+// which the toolsets this builds with do not provide.
+struct TextMemoryResource {
+  virtual ~TextMemoryResource() {}
+  virtual void* allocate(size_t size, size_t alignment) = 0;
+  virtual void deallocate(void* p, size_t size, size_t alignment) = 0;
+};
+
+// A monotonic memory resource: allocations are carved out of chunks, deallocate does nothing, and
+// everything is freed at once by reset() or the destructor. The first chunk is inside the arena, so
+// a small render into an arena on the stack never touches the heap, and chunks double in size so a
+// large one only takes a few. Not thread-safe; use one arena per thread.
+struct TextArena : public TextMemoryResource {
+  TextArena();
+  ~TextArena();
+  void* allocate(size_t size, size_t alignment) override;
+  void deallocate(void*, size_t, size_t) override {}
+  // Frees all chunks but the inline one. Anything still using memory from the arena, like a
+  // RenderState, must be destroyed first.
+  void reset();
+
+  static const size_t INLINE_CHUNK_SIZE = 4096;
+  static const size_t MIN_CHUNK_SIZE = 64 * 1024;
+
+  struct Chunk {
+    Chunk* next;
+  };
+
+  Chunk* chunks;        // heap chunks, most recent first
+  char* at;             // next free byte of the current chunk
+  char* end;
+  size_t nextChunkSize;
+  size_t bytesAllocated;  // total of all allocation sizes since construction or reset()
+  char inlineChunk[INLINE_CHUNK_SIZE];
+
+private:
+  TextArena(const TextArena&);
+  TextArena& operator=(const TextArena&);
+};
+
+// Makes another resource safe to allocate from on several threads at once, for the parts of a render
+// that run on a TextThreadPool. upstream NULL means the global heap.
+struct TextLockedResource : public TextMemoryResource {
+  TextLockedResource(TextMemoryResource* upstream = NULL) : upstream(upstream) {}
+  void* allocate(size_t size, size_t alignment) override;
+  void deallocate(void* p, size_t size, size_t alignment) override;
+
+  TextMemoryResource* upstream;
+  std::mutex mutex;
+};
+
+// Counts what goes through it to another resource, or to the global heap if upstream is NULL: the
+// allocations, the bytes they asked for, and the most bytes live at any one time. Live bytes go down
+// when memory is given back even if upstream is an arena, so the peak is what the render needed.
+// Not thread-safe; a RenderState with a pool wraps it in its TextLockedResource.
+struct TextCountingResource : public TextMemoryResource {
+  TextCountingResource(TextMemoryResource* upstream = NULL) : upstream(upstream) { reset(); }
+  void* allocate(size_t size, size_t alignment) override;
+  void deallocate(void* p, size_t size, size_t alignment) override;
+  void reset();   // the counts only; memory still allocated is not freed
+
+  TextMemoryResource* upstream;
+  long long numAllocations;
+  long long bytesAllocated;
+  long long liveBytes;
+  long long peakLiveBytes;
+};
+
+// -------------------------------------------------------------------------------------------------
+
+// STL allocator that takes its memory from a TextMemoryResource, or from the global heap if the
+// resource is NULL. Copies of a container keep the resource of the original.
+template <typename T>
+struct TextAllocator {
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+  template <typename U> struct rebind { typedef TextAllocator<U> other; };
+
+  TextAllocator(TextMemoryResource* resource = NULL) : resource(resource) {}
+  template <typename U>
+  TextAllocator(const TextAllocator<U>& other) : resource(other.resource) {}
+
+  T* allocate(size_t n) {
+    if (resource == NULL) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(resource->allocate(n * sizeof(T), std::alignment_of<T>::value));
+  }
+  void deallocate(T* p, size_t n) {
+    if (resource == NULL) {
+      ::operator delete(p);
+    } else {
+      resource->deallocate(p, n * sizeof(T), std::alignment_of<T>::value);
+    }
+  }
+
+  TextMemoryResource* resource;
+};
+
+template <typename T, typename U>
+bool operator==(const TextAllocator<T>& a, const TextAllocator<U>& b) { return a.resource == b.resource; }
+template <typename T, typename U>
+bool operator!=(const TextAllocator<T>& a, const TextAllocator<U>& b) { return a.resource != b.resource; }
+
+template <typename T>
+using TextVector = std::vector<T, TextAllocator<T> >;
+typedef std::basic_string<char, std::char_traits<char>, TextAllocator<char> > TextString;
+
+#endif
@@ -1,12 +1,22 @@
 #include "ast.h"
 #include "visitor.h"
+#include "scan.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <algorithm>
+#include <string.h>
+#include <limits.h>
 #include <cctype>
 
 void LiteralLength::print() const {
-  printf("%d", value);
+  if (value == RENDER_WIDTH) {
+    printf("*");
+  } else if (value == ARG_LENGTH) {
+    printf("$");
+  } else {
+    printf("%d", value);
+  }
   if (shares) {
     printf("s");
   }
@@ -40,6 +50,9 @@ void RepeatedCharFL::print() const {
 
 void Words::print() const {
   printf("{w");
+  if (balanced) {
+    printf("=");
+  }
   if (wordSilhouette) {
     printf("->'%c'", wordSilhouette);
   }
@@ -72,23 +85,26 @@ void Block::print() const {
   printf(" }");
 }
 
-void Block::addChild(ASTPtr child) {
+void Block::addChild(ASTPtr child, DSLError* error) {
   if (child->type == BLOCK) {
     if (hasWords()) {
-      throw DSLException(child->f_at, "Parent block cannot contain both a child block and words.");
+      error->set(child->f_at, "Parent block cannot contain both a child block and words.");
+      return;
     }
   } else if (child->type == REPEATED_CHAR_FL) {
     hasFLChild = true;
   }
   children.push_back(std::move(child));
 }
-void Block::addWords(ASTPtr words) {
+void Block::addWords(ASTPtr words, DSLError* error) {
   if (hasWords()) {
-    throw DSLException(words->f_at, "Cannot have multiple words blocks within a block.");
+    error->set(words->f_at, "Cannot have multiple words blocks within a block.");
+    return;
   }
   for (const ASTPtr& child : children) {
     if (child->type == BLOCK) {
-      throw DSLException(child->f_at, "Parent block cannot contain both a child block and words.");
+      error->set(child->f_at, "Parent block cannot contain both a child block and words.");
+      return;
     }
   }
   wordsIndex = children.size();
@@ -100,20 +116,24 @@ bool Block::hasWords() const {
 
 void ConsistentContent::print() const {
   printf("%d:%d [", startCol, endCol);
-  for (const ASTPtr& child : children) {
+  for (const AST* child : children) {
     printf(" ");
     child->print();
   }
   printf(" ]");
   printf("^{");
-  for (const FillerPtr& filler : topFillers) {
-    printf(" ");
-    filler->print();
+  for (const Block* block : blocks) {
+    for (const FillerPtr& filler : block->topFillers) {
+      printf(" ");
+      filler->print();
+    }
   }
   printf(" }v{");
-  for (const FillerPtr& filler : bottomFillers) {
-    printf(" ");
-    filler->print();
+  for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+    for (const FillerPtr& filler : (*it)->bottomFillers) {
+      printf(" ");
+      filler->print();
+    }
   }
   printf(" }");
 }
@@ -140,149 +160,352 @@ void Block::accept(Visitor* v) {
 }
 
 // -------------------------------------------------------------------------------------------------
+// Fills are written in bulk: memset into buffers, and fwrite of a filled chunk into streams.
+static const int PUT_CHARS_CHUNK_SIZE = 256;
+
 static void putChars(FILE* stream, char c, int n) {
-  for (int i = 0; i < n; ++i) {
-    fputc(c, stream);
+  if (n <= 0) {
+    return;
   }
+  char chunk[PUT_CHARS_CHUNK_SIZE];
+  memset(chunk, c, n < PUT_CHARS_CHUNK_SIZE ? n : PUT_CHARS_CHUNK_SIZE);
+  while (n > PUT_CHARS_CHUNK_SIZE) {
+    fwrite(chunk, 1, PUT_CHARS_CHUNK_SIZE, stream);
+    n -= PUT_CHARS_CHUNK_SIZE;
+  }
+  fwrite(chunk, 1, n, stream);
 }
 static void putChars(char** bufAt, char c, int n) {
-  for (int i = 0; i < n; ++i) {
-    **bufAt = c;
-    ++*bufAt;
+  if (n <= 0) {
+    return;
   }
+  memset(*bufAt, c, n);
+  *bufAt += n;
 }
 
-void StringLiteral::printContent(FILE* stream) const {
-  fprintf(stream, "%s", str.c_str());
-}
-void StringLiteral::printContent(char** bufAt) const {
-  *bufAt += str.copy(*bufAt, str.length()); // does not append '\0'
-}
-
-void RepeatedCharLL::printContent(FILE* stream) const {
-  putChars(stream, c, length.value);
+void CCLine::printContent(FILE* stream) const {
+  for (const CCSegment& segment : segments) {
+    if (segment.kind == SEGMENT_CHARS) {
+      fwrite(segment.chars, 1, segment.length, stream);
+    } else {
+      putChars(stream, segment.c, segment.length);
+    }
+  }
 }
-void RepeatedCharLL::printContent(char** bufAt) const {
-  putChars(bufAt, c, length.value);
+void CCLine::printContent(char** bufAt) const {
+  for (const CCSegment& segment : segments) {
+    if (segment.kind == SEGMENT_CHARS) {
+      memcpy(*bufAt, segment.chars, segment.length);
+      *bufAt += segment.length;
+    } else {
+      putChars(bufAt, segment.c, segment.length);
+    }
+  }
 }
 
 // -------------------------------------------------------------------------------------------------
 
-static void llSharesToLength(int totalLength, const std::vector<LiteralLength*>& lls, const char* f_at) {
+// llSharesToLength distributes over ranges of either LiteralLength* or CCSegment.
+static int& llValue(LiteralLength* ll) { return ll->value; }
+static bool& llShares(LiteralLength* ll) { return ll->shares; }
+static int& llValue(CCSegment& segment) { return segment.length; }
+static bool& llShares(CCSegment& segment) { return segment.shares; }
+
+// Largest-remainder distribution of length over share counts totalling totalShares: share count s
+// gets s * length / totalShares, and what is left over goes one each to the largest remainders
+// s * length % totalShares, earliest first among equal remainders. All integer, so the result is
+// exact, and the share counts are iterated by the caller, so nothing is allocated.
+struct ShareDistribution {
+  ShareDistribution(int length, int totalShares)
+    : length(length), totalShares(totalShares), threshold(totalShares), numAtThreshold(0),
+    narrow((long long)length * totalShares <= INT_MAX) {}
+
+  // No share count exceeds totalShares, so if narrow, the products fit in an int.
+  int floorLength(int shares) const {
+    return narrow ? shares * length / totalShares : (int)((long long)shares * length / totalShares);
+  }
+  int remainder(int shares) const {
+    return narrow ? shares * length % totalShares : (int)((long long)shares * length % totalShares);
+  }
+
+  // Picks the remainders that get the leftover length. countAtLeast(r) must return how many share
+  // counts have a remainder of at least r. Binary search over the remainder values instead of a
+  // sort: O(number of shares * log(totalShares)).
+  template <typename CountAtLeast>
+  void setThreshold(int leftover, CountAtLeast countAtLeast) {
+    if (leftover == 0) {
+      return;
+    }
+    int lo = 0, hi = totalShares - 1;
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (countAtLeast(mid) >= leftover) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    threshold = lo;
+    numAtThreshold = leftover - countAtLeast(lo + 1);
+  }
+
+  // The length of the next share count, in order.
+  int nextLength(int shares) {
+    int r = remainder(shares);
+    int l = floorLength(shares);
+    if (r > threshold) {
+      ++l;
+    } else if (r == threshold && numAtThreshold > 0) {
+      ++l;
+      --numAtThreshold;
+    }
+    return l;
+  }
+
+  int length;
+  int totalShares;
+  int threshold;
+  int numAtThreshold;
+  bool narrow;
+};
+
+static void distributeShares(int length, int totalShares, const int* shares, int numShares,
+                             int* lengths) {
+  ShareDistribution distribution(length, totalShares);
+  int leftover = length;
+  for (int i = 0; i < numShares; ++i) {
+    leftover -= distribution.floorLength(shares[i]);
+  }
+  distribution.setThreshold(leftover, [&](int minRemainder) {
+    int count = 0;
+    for (int i = 0; i < numShares; ++i) {
+      count += (distribution.remainder(shares[i]) >= minRemainder);
+    }
+    return count;
+  });
+  for (int i = 0; i < numShares; ++i) {
+    lengths[i] = distribution.nextLength(shares[i]);
+  }
+}
+
+// Returns the error message if the lengths can't be distributed, or NULL once they are.
+template <typename LLIter>
+static const char* distributeLLShares(int totalLength, LLIter llsBegin, LLIter llsEnd) {
   int lengthRemaining = totalLength;
   int totalShareCount = 0;
-  std::vector<LiteralLength*> shareLLs;
-  for (LiteralLength* ll : lls) {
-    if (ll->shares) {
-      totalShareCount += ll->value;
-      shareLLs.push_back(ll);
+  for (LLIter ll = llsBegin; ll != llsEnd; ++ll) {
+    if (llShares(*ll)) {
+      totalShareCount += llValue(*ll);
     } else {
-      lengthRemaining -= ll->value;
+      lengthRemaining -= llValue(*ll);
     }
   }
   if (lengthRemaining < 0) {
-    throw DSLException(f_at, "Sum of length of fixed-length content exceeds available length.");
+    return "Sum of length of fixed-length content exceeds available length.";
   }
   if (totalShareCount == 0) {
     if (lengthRemaining > 0) {
-      throw DSLException(f_at, "No share-length content to distribute remaining length to.");
+      return "No share-length content to distribute remaining length to.";
     }
     // Distributing 0 length amongst 0 total shares is fine: all resulting share lengths are 0.
-    for (LiteralLength* ll : lls) {
-      if (ll->shares) {
-        ll->value = 0;
-        ll->shares = false;
+    for (LLIter ll = llsBegin; ll != llsEnd; ++ll) {
+      if (llShares(*ll)) {
+        llValue(*ll) = 0;
+        llShares(*ll) = false;
       }
     }
-    return;
+    return NULL;
   }
-  // Initially, distribute from the total length so that each length is the floor of its target
-  // value based on uniform shares.
-  float avgShareLength = lengthRemaining / (float)totalShareCount;
-  std::vector<float> deltas(shareLLs.size());
-  for (int i = 0; i < shareLLs.size(); ++i) {
-    float targetLength = shareLLs[i]->value * avgShareLength;
-    int length = floorf(targetLength);
-    shareLLs[i]->value = length;
-    shareLLs[i]->shares = false;
-    deltas[i] = targetLength - length;
-    lengthRemaining -= length;
+  ShareDistribution distribution(lengthRemaining, totalShareCount);
+  int leftover = lengthRemaining;
+  for (LLIter ll = llsBegin; ll != llsEnd; ++ll) {
+    if (llShares(*ll)) {
+      leftover -= distribution.floorLength(llValue(*ll));
+    }
   }
-  // lengthRemaining should be less than shareCounts.size(), but do this anyway in case of numerical
-  // error
-  while (lengthRemaining >= shareLLs.size()) {
-    for (int i = 0; i < shareLLs.size(); ++i) {
-      shareLLs[i]->value++;
-      deltas[i] -= 1.f;
+  distribution.setThreshold(leftover, [&](int minRemainder) {
+    int count = 0;
+    for (LLIter ll = llsBegin; ll != llsEnd; ++ll) {
+      count += (llShares(*ll) && distribution.remainder(llValue(*ll)) >= minRemainder);
     }
-    lengthRemaining -= shareLLs.size();
+    return count;
+  });
+  for (LLIter ll = llsBegin; ll != llsEnd; ++ll) {
+    if (llShares(*ll)) {
+      llValue(*ll) = distribution.nextLength(llValue(*ll));
+      llShares(*ll) = false;
+    }
+  }
+  return NULL;
+}
+
+template <typename LLIter>
+static void llSharesToLength(int totalLength, LLIter llsBegin, LLIter llsEnd, const char* f_at) {
+  const char* error = distributeLLShares(totalLength, llsBegin, llsEnd);
+  if (error != NULL) {
+    throw DSLException(f_at, error);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+void SharesPlan::compile() {
+  totalShares = 0;
+  for (int s : shares) {
+    totalShares += s;
   }
-  // Distribute remaining length to the lengths with the largest deltas.
-  int n = deltas.size() - 1 - lengthRemaining;
-  std::vector<float> deltasCopy(deltas);
-  std::nth_element(deltasCopy.begin(), deltasCopy.begin() + n, deltasCopy.end());
-  float deltaThreshold = deltasCopy[n];
-  for (int i = 0; i < shareLLs.size() && lengthRemaining > 0; ++i) {
-    if (deltas[i] > deltaThreshold) {
-      shareLLs[i]->value++;
-      --lengthRemaining;
+  table.clear();
+  int numShares = shares.size();
+  if (totalShares > 0 && (long long)totalShares * numShares <= MAX_TABLE_SIZE) {
+    table.resize(totalShares * numShares);
+    for (int r = 0; r < totalShares; ++r) {
+      distributeShares(r, totalShares, shares.data(), numShares, &table[r * numShares]);
     }
   }
-  for (int i = 0; i < shareLLs.size() && lengthRemaining > 0; ++i) {
-    if (deltas[i] == deltaThreshold) {
-      shareLLs[i]->value++;
-      --lengthRemaining;
+  compiled = true;
+}
+
+// Without shares, llSharesToLength reports any remaining length, so there is no plan.
+static void compileIfShares(SharesPlan* plan) {
+  int totalShares = 0;
+  for (int s : plan->shares) {
+    totalShares += s;
+  }
+  if (totalShares > 0) {
+    plan->compile();
+  }
+}
+
+void SharesPlan::distribute(int length, int numRepeats, CCSegment* begin, CCSegment* end) const {
+  assert(compiled && totalShares > 0 && numRepeats > 0);
+  int numShares = shares.size();
+  int q = length / totalShares;
+  const int* remainderLengths = NULL;
+  ShareDistribution distribution(length, totalShares * numRepeats);
+  if (numRepeats == 1 && !table.empty()) {
+    remainderLengths = &table[(length % totalShares) * numShares];
+  } else {
+    // A share count has the same remainder in every repeat, so only one repeat is looked at. This is
+    // also the fallback when there are too many shares to tabulate; still no sorting or allocating.
+    int leftover = length;
+    for (int s : shares) {
+      leftover -= numRepeats * distribution.floorLength(s);
     }
+    distribution.setThreshold(leftover, [&](int minRemainder) {
+      int count = 0;
+      for (int s : shares) {
+        count += (distribution.remainder(s) >= minRemainder);
+      }
+      return numRepeats * count;
+    });
   }
-  assert(lengthRemaining == 0);
+  int i = 0;
+  for (CCSegment* segment = begin; segment != end; ++segment) {
+    if (!segment->shares) {
+      continue;
+    }
+    assert(segment->length == shares[i]);
+    if (remainderLengths != NULL) {
+      segment->length = shares[i] * q + remainderLengths[i];
+    } else {
+      segment->length = distribution.nextLength(shares[i]);
+    }
+    segment->shares = false;
+    if (++i == numShares) {
+      i = 0;
+    }
+  }
+  assert(i == 0);
+}
+
+// The length left for the shares in [begin, end) after the fixed lengths.
+static int shareLengthRemaining(int totalLength, const CCSegment* begin, const CCSegment* end,
+                                int* numShareSegments, const char* f_at) {
+  int lengthRemaining = totalLength;
+  *numShareSegments = 0;
+  for (const CCSegment* segment = begin; segment != end; ++segment) {
+    if (segment->shares) {
+      ++*numShareSegments;
+    } else {
+      lengthRemaining -= segment->length;
+    }
+  }
+  if (lengthRemaining < 0) {
+    throw DSLException(f_at, "Sum of length of fixed-length content exceeds available length.");
+  }
+  return lengthRemaining;
+}
+
+
+int AST::getFixedLength(const Layout& layout) const {
+  if (getLiteralLength() == NULL) {
+    return UNKNOWN_COL;
+  }
+  const LiteralLength& length = layout.nodes[nodeIndex].length;
+  return length.shares ? UNKNOWN_COL : length.value;
 }
 
+LiteralLength* AST::getLiteralLength(Layout* layout) const {
+  return getLiteralLength() != NULL ? &layout->nodes[nodeIndex].length : NULL;
+}
 
-void AST::convertLLSharesToLength() {
+void AST::convertLLSharesToLength(Layout* layout, DSLError* error) const {
   // Parent block is expected to do the conversion. As for the root node, it's expected to be
   // fixed-length to begin with (expected to be verified by parser).
 }
 
-void Block::convertLLSharesToLength() {
+void Block::convertLLSharesToLength(Layout* layout, DSLError* error) const {
+  const LiteralLength& length = layout->nodes[nodeIndex].length;
   if (length.shares) {
-    throw DSLException(f_at, "Block length is line-dependent.");
+    error->set(f_at, "Block length is line-dependent.");
+    return;
   }
   if (!hasWords() && !hasFLChild) {
     // None of the content varies line-by-line, so all children have consistent length and positions
     // Note this means that all children have literal length.
-    std::vector<LiteralLength*> lls;
+    TextVector<LiteralLength*> lls(layout->nodes.get_allocator());
     for (const ASTPtr& child : children) {
-      LiteralLength* ll = child->getLiteralLength();
+      LiteralLength* ll = child->getLiteralLength(layout);
       assert(ll != NULL);
       lls.push_back(ll);
     }
-    llSharesToLength(length.value, lls, f_at);  // modifies the LiteralLength of all children to fixed lengths
+    // modifies the LiteralLength of all children to fixed lengths
+    const char* sharesError = distributeLLShares(length.value, lls.begin(), lls.end());
+    if (sharesError != NULL) {
+      error->set(f_at, sharesError);
+      return;
+    }
+    ++layout->numShareDistributions;
     for (const ASTPtr& child : children) {
-      assert(child->getFixedLength() != UNKNOWN_COL);
+      assert(child->getFixedLength(*layout) != UNKNOWN_COL);
     }
   }
   for (const ASTPtr& child : children) {
-    child->convertLLSharesToLength();
+    child->convertLLSharesToLength(layout, error);
+    if (error->message != NULL) {
+      return;
+    }
   }
 }
 
 
-void AST::computeStartEndCols(int start, int end) {
-  startCol = start;
-  endCol = end;
-//printf("\n%s\n", f_at);
-//printf("\t%d:%d, %d\n", startCol, endCol, getFixedLength());
+void AST::computeStartEndCols(Layout* layout, int start, int end, DSLError* error) const {
+  NodeLayout& nodeLayout = layout->nodes[nodeIndex];
+  nodeLayout.startCol = start;
+  nodeLayout.endCol = end;
 }
 
-void Block::computeStartEndCols(int start, int end) {
-  startCol = start;
-  endCol = end;
-//printf("\n%s\n", f_at);
-//printf("\t%d:%d, %d\n", startCol, endCol, getFixedLength());
+void Block::computeStartEndCols(Layout* layout, int start, int end, DSLError* error) const {
+  NodeLayout& nodeLayout = layout->nodes[nodeIndex];
+  nodeLayout.startCol = start;
+  nodeLayout.endCol = end;
+  int startCol = start;
+  int endCol = end;
   if (startCol == UNKNOWN_COL || endCol == UNKNOWN_COL) {
-    throw DSLException(f_at, "Block bondaries are line-dependent.");
+    error->set(f_at, "Block bondaries are line-dependent.");
+    return;
   }
-  assert(endCol - startCol == length.value);
+  assert(endCol - startCol == nodeLayout.length.value);
 
   // some content varies line-by-line, so only consecutive fixed-length children starting from
   // either end of this block have consistent starting positions.
@@ -292,13 +515,16 @@ void Block::computeStartEndCols(int start, int end) {
     for (; i < children.size(); ++i) {
       const ASTPtr& child = children[i];
       int childEndCol = UNKNOWN_COL;
-      int childNumCols = child->getFixedLength();
+      int childNumCols = child->getFixedLength(*layout);
       if (childNumCols != UNKNOWN_COL) {
         childEndCol = iStartCol + childNumCols;
       } else {
         break;
       }
-      child->computeStartEndCols(iStartCol, childEndCol);
+      child->computeStartEndCols(layout, iStartCol, childEndCol, error);
+      if (error->message != NULL) {
+        return;
+      }
       iStartCol = childEndCol;
     }
   }
@@ -308,20 +534,26 @@ void Block::computeStartEndCols(int start, int end) {
     for (int j = children.size() - 1; j > i; --j) {
       const ASTPtr& child = children[j];
       int childStartCol = UNKNOWN_COL;
-      int childNumCols = child->getFixedLength();
+      int childNumCols = child->getFixedLength(*layout);
       if (childNumCols != UNKNOWN_COL && jEndCol != UNKNOWN_COL) {
         childStartCol = jEndCol - childNumCols;
       }
-      child->computeStartEndCols(childStartCol, jEndCol);
+      child->computeStartEndCols(layout, childStartCol, jEndCol, error);
+      if (error->message != NULL) {
+        return;
+      }
       jEndCol = childStartCol;
     }
-    children[i]->computeStartEndCols(iStartCol, jEndCol);
+    children[i]->computeStartEndCols(layout, iStartCol, jEndCol, error);
   }
 }
 
 
-void AST::flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* ccs, bool firstAfterBlockBoundary,
-                  std::vector<FillerPtr>* topFillersStack, std::vector<FillerPtr>* bottomFillersStack) {
+void AST::flatten(const Block* parent, Layout* layout, bool firstAfterBlockBoundary,
+                  TextVector<const Block*>* blocksStack) const {
+  TextVector<ConsistentContent>* ccs = &layout->ccs;
+  int startCol = layout->nodes[nodeIndex].startCol;
+  int endCol = layout->nodes[nodeIndex].endCol;
   bool startNewCC;
   bool newCCChildrenConsistent;
   
@@ -344,7 +576,7 @@ void AST::flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* cc
   ConsistentContent* cc = NULL;
   if (startNewCC) {
     ccs->push_back(ConsistentContent(parent, newCCChildrenConsistent, startCol, UNKNOWN_COL,
-                                     *topFillersStack, *bottomFillersStack));
+                                     *blocksStack));
     cc = &ccs->back();
   } else {
     assert(!ccs->empty());
@@ -353,98 +585,93 @@ void AST::flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* cc
   if (type == WORDS) {
     cc->wordsIndex = cc->children.size();
     cc->words = static_cast<const Words*>(this);
-    //cc->s_at = cc->words->source.c_str();
+    // compute interwordHasShares and interwordFixedLength
+    cc->interwordFixedLength = 0;
+    cc->interwordHasShares = false;
+    cc->interwordPlan.shares.clear();
+    for (const FillerPtr& filler : cc->words->interwordFillers) {
+      if (!filler->length.shares) {
+        cc->interwordFixedLength += filler->length.value;
+      } else {
+        cc->interwordHasShares = true;
+        cc->interwordPlan.shares.push_back(filler->length.value);
+      }
+    }
+    compileIfShares(&cc->interwordPlan);
   }
-  cc->children.push_back(self);
+  cc->children.push_back(this);
   cc->endCol = endCol;
 }
 
-void Block::flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* ccs, bool firstAfterBlockBoundary,
-                    std::vector<FillerPtr>* topFillersStack, std::vector<FillerPtr>* bottomFillersStack) {
-  topFillersStack->insert(topFillersStack->end(), topFillers.begin(), topFillers.end());
-  bottomFillersStack->insert(bottomFillersStack->begin(), bottomFillers.begin(), bottomFillers.end());
+void Block::flatten(const Block* parent, Layout* layout, bool firstAfterBlockBoundary,
+                    TextVector<const Block*>* blocksStack) const {
+  blocksStack->push_back(this);
   bool firstAfterBlockBegin = true;
   bool prevWasBlock = false;
   for (int i = 0; i < children.size(); ++i) {
-    ASTPtr& child = children[i];
+    const ASTPtr& child = children[i];
     bool isBlock = (child->type == BLOCK);
     bool firstAfterBlockEnd = (prevWasBlock && !isBlock);
-    child->flatten(child, self, ccs, firstAfterBlockBegin || firstAfterBlockEnd, topFillersStack, bottomFillersStack);
+    child->flatten(this, layout, firstAfterBlockBegin || firstAfterBlockEnd, blocksStack);
     firstAfterBlockBegin = false;
     prevWasBlock = isBlock;
   }
-  topFillersStack->resize(topFillersStack->size() - topFillers.size());
-  bottomFillersStack->erase(bottomFillersStack->begin(), bottomFillersStack->begin() + bottomFillers.size());
+  blocksStack->pop_back();
 }
  
 
-FillerPtr RepeatedCharFL::toRepeatedCharLL(int line) const{
-  assert(line >= 0);
-  return FillerPtr(new RepeatedCharLL(f_at, length.toLiteralLength(line), c));
-}
-
-static bool isSpace(char c) {
-  return (c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v');
-}
-
+// Word boundaries are found by the fastest scanner the CPU supports.
 static const char* parseWhitespacesExceptNewline(const char* s_at) {
-  while (isSpace(*s_at) && *s_at != '\n') {
-    ++s_at;
-  }
-  return s_at;
+  return bestScanner().skipSpacesExceptNewline(s_at);
 }
 static const char* parseUntilWhitespace(const char* s_at) {
-  while (*s_at != '\0' && !isSpace(*s_at)) {
-    ++s_at;
-  }
-  return s_at;
+  return bestScanner().skipWord(s_at);
 }
 
-static void deepCopyFillers(const std::vector<FillerPtr>& src, std::vector<FillerPtr>* dst) {
-  dst->clear();
-  for (const FillerPtr& filler : src) {
-    if (filler->type == REPEATED_CHAR_LL) {
-      const RepeatedCharLL* rcLL = static_cast<const RepeatedCharLL*>(filler.get());
-      dst->push_back(FillerPtr(new RepeatedCharLL(*rcLL)));
-    } else {
-      const StringLiteral* sl = static_cast<const StringLiteral*>(filler.get());
-      dst->push_back(FillerPtr(new StringLiteral(*sl))); 
-      // deep copy of StringLiteral not really needed for our purposes, but do it anyway in case
-      //dst->push_back(filler);
-    }
-  }
+static CCSegment charsSegment(const char* chars, int length) {
+  CCSegment segment = { SEGMENT_CHARS, '\0', false, length, chars };
+  return segment;
 }
-
-static FillerPtr wordtoContent(const char* src, int size, char silhouette, const char* f_at) {
-  if (silhouette != '\0') {
-    return FillerPtr(new RepeatedCharLL(f_at, LiteralLength(size, false), silhouette));
+static CCSegment fillSegment(char c, const LiteralLength& length) {
+  CCSegment segment = { SEGMENT_FILL, c, length.shares, length.value, NULL };
+  return segment;
+}
+// Interword fillers are either string literals or repeated chars with literal length.
+static CCSegment fillerSegment(const Filler& filler) {
+  if (filler.type == REPEATED_CHAR_LL) {
+    return fillSegment(static_cast<const RepeatedCharLL&>(filler).c, filler.length);
   } else {
-    return FillerPtr(new StringLiteral(f_at, src, size));
+    const StringLiteral& sl = static_cast<const StringLiteral&>(filler);
+    return charsSegment(sl.str.data(), sl.str.length());
   }
 }
 
-static const char* wordsLineToContents(const Words& words, const char* s_at, int interwordMinLength,
-                                       int lineMaxLength, std::vector<FillerPtr>* wordsContents) {
-  assert(interwordMinLength >= 0);
-  wordsContents->clear();
+// Finds the words of the source that fit on one line, at most maxNumWords of them, calling
+// onWord(word, wordLength) for each of them in order, and returns where the next line starts.
+// Interword fillers go between words on the same line. Shared by the line generation and the line
+// counting so both break lines identically.
+template <typename OnWord>
+static const char* wrapWordsLine(const char* s_at, int interwordMinLength, int lineMaxLength, int maxNumWords,
+                                 OnWord onWord) {
+  assert(interwordMinLength >= 0 && maxNumWords >= 1);
   int remainingLength = lineMaxLength;
+  int numWords = 1;
 
   s_at = parseWhitespacesExceptNewline(s_at);
   /*if (*s_at == '\0') {
     return s_at;
   }*/
   // Add as many words and interword fillers as the maxWordsLength allows
-  // Interword fillers only go between words on the same line.
   const char* firstWordEnd = parseUntilWhitespace(s_at);
   int firstWordLength = firstWordEnd - s_at;
   if (firstWordLength > lineMaxLength) {
     // First word is longer than max line length; push as much of the word as allowed, and pretend
     // the next word starts where we left off.
-    wordsContents->push_back(wordtoContent(s_at, lineMaxLength, words.wordSilhouette, words.f_at));
+    onWord(s_at, lineMaxLength);
     s_at += lineMaxLength;
     remainingLength = 0;
   } else {
-    wordsContents->push_back(wordtoContent(s_at, firstWordLength, words.wordSilhouette, words.f_at));
+    onWord(s_at, firstWordLength);
     s_at = firstWordEnd;
     remainingLength -= firstWordLength;
     
@@ -455,6 +682,8 @@ static const char* wordsLineToContents(const Words& words, const char* s_at, int
       } else if (*s_at == '\n') {
         ++s_at;
         break;
+      } else if (numWords == maxNumWords) {
+        break;
       }
       // Check if there's enough room for interword fillers and another word.  If yes, insert 
       // interword fillers and the next word.  Otherwise, bail
@@ -462,12 +691,10 @@ static const char* wordsLineToContents(const Words& words, const char* s_at, int
       int wordLength = wordEnd - s_at;
       assert(wordLength > 0);
       if (interwordMinLength + wordLength <= remainingLength) {
-        std::vector<FillerPtr> interwordsCopy;
-        deepCopyFillers(words.interwordFillers, &interwordsCopy);
-        wordsContents->insert(wordsContents->end(), interwordsCopy.begin(), interwordsCopy.end());
-        wordsContents->push_back(wordtoContent(s_at, wordLength, words.wordSilhouette, words.f_at));
+        onWord(s_at, wordLength);
         s_at = wordEnd;
         remainingLength -= (interwordMinLength + wordLength);
+        ++numWords;
       } else {
         break;
       }
@@ -477,241 +704,709 @@ static const char* wordsLineToContents(const Words& words, const char* s_at, int
   return s_at;
 }
 
-void ConsistentContent::generateCCLine(int lineNum, CCLine* line) {
+// Appends the words that fit on one line, and the interword fillers between them, to segments.
+// Words are referenced in place in the source unless they have a silhouette.
+static const char* wordsLineToSegments(const Words& words, const char* s_at, int interwordMinLength,
+                                       int lineMaxLength, int maxNumWords, TextVector<CCSegment>* segments) {
+  bool firstWord = true;
+  return wrapWordsLine(s_at, interwordMinLength, lineMaxLength, maxNumWords, [&](const char* word, int wordLength) {
+    if (!firstWord) {
+      for (const FillerPtr& filler : words.interwordFillers) {
+        segments->push_back(fillerSegment(*filler));
+      }
+    }
+    firstWord = false;
+    if (words.wordSilhouette != '\0') {
+      segments->push_back(fillSegment(words.wordSilhouette, LiteralLength(wordLength, false)));
+    } else {
+      segments->push_back(charsSegment(word, wordLength));
+    }
+  });
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static const long long UNFIT_COST = LLONG_MAX / 4;   // a line that is too long; sums cannot overflow
+
+const char* BalancedBreaks::breakParagraph(const char* s_at, int interwordMinLength, int lineMaxLength) {
+  // Split the paragraph into pieces exactly as wrapWordsLine would
+  ends.clear();
+  ends.push_back(0);
+  for (;;) {
+    s_at = parseWhitespacesExceptNewline(s_at);
+    if (*s_at == '\0' || *s_at == '\n') {
+      break;
+    }
+    const char* wordEnd = parseUntilWhitespace(s_at);
+    int wordLength = wordEnd - s_at;
+    for (; wordLength > lineMaxLength; wordLength -= lineMaxLength) {
+      ends.push_back(ends.back() + lineMaxLength + interwordMinLength);
+    }
+    if (wordLength > 0) {
+      ends.push_back(ends.back() + wordLength + interwordMinLength);
+    }
+    s_at = wordEnd;
+  }
+  if (*s_at == '\n') {
+    ++s_at;
+  }
+  reset();
+  int n = ends.size() - 1;
+  if (n == 0) {
+    lineNumWords.push_back(1);  // a blank line, like wrapWordsLine produces
+    return s_at;
+  }
+
+  // costOf(i, j): least cost of the lines of pieces [0, j) if the last one is [i, j)
+  costs.assign(n + 1, 0);
+  prevBreaks.assign(n + 1, 0);
+  auto costOf = [&](int i, int j) -> long long {
+    long long unusedLength = lineMaxLength - (ends[j] - ends[i] - interwordMinLength);
+    return (unusedLength < 0) ? UNFIT_COST : costs[i] + unusedLength * unusedLength;
+  };
+  queueBreaks.clear();
+  queueStarts.clear();
+  int queueFront = 0;
+  for (int j = 1; j <= n; ++j) {
+    // Break j - 1 becomes a candidate. Once it is at least as good as an earlier one, it stays so for
+    // all later j, so it replaces the candidates at the back it beats from where they start.
+    int i = j - 1;
+    int start = j;
+    while (queueFront < queueBreaks.size()) {
+      int backStart = std::max(queueStarts.back(), j);
+      if (costOf(i, backStart) > costOf(queueBreaks.back(), backStart)) {
+        // Binary search for the first j it beats the back candidate at, if any
+        int lo = backStart + 1, hi = n + 1;
+        while (lo < hi) {
+          int mid = lo + (hi - lo) / 2;
+          if (costOf(i, mid) <= costOf(queueBreaks.back(), mid)) {
+            hi = mid;
+          } else {
+            lo = mid + 1;
+          }
+        }
+        start = lo;
+        break;
+      }
+      queueBreaks.pop_back();
+      queueStarts.pop_back();
+    }
+    if (start <= n) {
+      queueBreaks.push_back(i);
+      queueStarts.push_back(start);
+    }
+    queueFront = std::min(queueFront, (int)queueBreaks.size() - 1);
+    while (queueFront + 1 < queueBreaks.size() && queueStarts[queueFront + 1] <= j) {
+      ++queueFront;
+    }
+    costs[j] = costOf(queueBreaks[queueFront], j);
+    prevBreaks[j] = queueBreaks[queueFront];
+  }
+
+  // The last line costs nothing if it fits; of the equally good, prefer the shortest last line
+  int lastBreak = n - 1;
+  for (int i = n - 2; i >= 0 && ends[n] - ends[i] - interwordMinLength <= lineMaxLength; --i) {
+    if (costs[i] < costs[lastBreak]) {
+      lastBreak = i;
+    }
+  }
+  lineNumWords.push_back(n - lastBreak);
+  for (int j = lastBreak; j > 0; j = prevBreaks[j]) {
+    lineNumWords.push_back(j - prevBreaks[j]);
+  }
+  std::reverse(lineNumWords.begin(), lineNumWords.end());
+  return s_at;
+}
+
+int ConsistentContent::getFunctionLength(const RenderState& state, CCState* ccState, int k, const FunctionLength& length,
+                                         const char* f_at, int lineNum) const {
+  if (lineNum < 0) {
+    throw DSLException(f_at, "Expected a content line for '#' length.");
+  }
+  const TextLengthSource* source = NULL;
+  if (state.lengthSources != NULL) {
+    if (length.funcIndex >= state.lengthSources->numSources) {
+      throw DSLException(f_at, "Missing length source for '#' length.");
+    }
+    source = &state.lengthSources->sources[length.funcIndex];
+    if (source->lengths != NULL) {
+      // Already an array, so there is nothing to memoize
+      if (lineNum >= source->numLengths) {
+        throw DSLException(f_at, "Precomputed lengths end before this line.");
+      }
+      if (source->lengths[lineNum] < 0) {
+        throw DSLException(f_at, "Expected a non-negative length from the length source.");
+      }
+      return source->lengths[lineNum];
+    }
+    if (source->func == NULL && source->rangeFunc == NULL) {
+      throw DSLException(f_at, "Missing length source for '#' length.");
+    }
+  } else if (state.lengthFuncs == NULL) {
+    throw DSLException(f_at, "Missing length func for '#' length.");
+  }
+
+  TextVector<FunctionLengthsMemo>& funcLengths = ccState->funcLengths;
+  if ((int)funcLengths.size() <= k) {
+    funcLengths.resize(k + 1, FunctionLengthsMemo(funcLengths.get_allocator().resource));
+  }
+  FunctionLengthsMemo& memo = funcLengths[k];
+  int lineBase = lineNum - lineNum % TEXT_LENGTH_FILL_LINES;
+  if (memo.lengths.empty() || memo.lineBase != lineBase) {
+    memo.lineBase = lineBase;
+    memo.lengths.assign(TEXT_LENGTH_FILL_LINES, UNKNOWN_COL);
+  }
+  int& memoLength = memo.lengths[lineNum - lineBase];
+  if (memoLength != UNKNOWN_COL) {
+    return memoLength;
+  }
+  if (source != NULL && source->rangeFunc != NULL) {
+    // The whole block at a time, so a line is in the memo iff the rest of its block is
+    (*source->rangeFunc)(lineBase, lineBase + TEXT_LENGTH_FILL_LINES, memo.lengths.data(), source->context);
+    for (int& blockLength : memo.lengths) {
+      if (blockLength < 0) {
+        blockLength = UNKNOWN_COL;  // asked for again, and reported, if the line is needed
+      }
+    }
+  } else {
+    LengthFunc func = (source != NULL) ? source->func : state.lengthFuncs[length.funcIndex];
+    memoLength = std::max((*func)(lineNum), UNKNOWN_COL);
+  }
+  if (memoLength == UNKNOWN_COL) {
+    throw DSLException(f_at, "Expected a non-negative length from the length source.");
+  }
+  return memoLength;
+}
+
+const char* ConsistentContent::getWordSource(const RenderState& state) const {
+  assert(words != NULL);
+  if (state.wordSources == NULL || state.wordSources[words->sourceIndex] == NULL) {
+    throw DSLException(words->f_at, "Missing word source for Words.");
+  }
+  return state.wordSources[words->sourceIndex];
+}
+
+int ConsistentContent::getMaxWordsLength(const RenderState& state, CCState* ccState, int lineNum) const {
+  assert(words != NULL);
+  int maxWordsLength = endCol - startCol;
+  int k = 0;  // function lengths so far
+  for (const AST* child : children) {
+    switch (child->type) {
+    case STRING_LITERAL:
+    case REPEATED_CHAR_LL: {
+      const LiteralLength& length = state.layout->nodes[child->nodeIndex].length;
+      if (!length.shares) {
+        maxWordsLength -= length.value;
+      }
+    } break;
+    case REPEATED_CHAR_FL: {
+      const RepeatedCharFL* rcFL = static_cast<const RepeatedCharFL*>(child);
+      if (!rcFL->length.shares) {
+        maxWordsLength -= getFunctionLength(state, ccState, k, rcFL->length, rcFL->f_at, lineNum);
+      }
+      ++k;
+    } break;
+    default:
+      break;
+    }
+  }
+  if (maxWordsLength <= 0) {
+    throw DSLException(words->f_at, "No length remaining for words.");
+  }
+  return maxWordsLength;
+}
+
+int ConsistentContent::getBalancedWordsLength(const RenderState& state, CCState* ccState) const {
+  assert(words != NULL && words->balanced);
+  for (const AST* child : children) {
+    if (child->type == REPEATED_CHAR_FL && !static_cast<const RepeatedCharFL*>(child)->length.shares) {
+      throw DSLException(words->f_at, "Balanced words need the same length on every line.");
+    }
+  }
+  return getMaxWordsLength(state, ccState, 0);
+}
+
+void ConsistentContent::checkLineShares(const RenderState& state, CCState* ccState, int lineNum, int maxWordsLength,
+                                        int usedLength, int numWords) const {
+  if (linePlan.compiled) {
+    return;   // every line has the same shares, and they are not 0
+  }
+  // Interword fillers with shares take the words' whole length once there are two words
+  int unusedLength = (interwordHasShares && numWords > 1) ? 0 : maxWordsLength - usedLength;
+  if (unusedLength == 0) {
+    return;
+  }
+  int k = 0;  // function lengths so far
+  for (const AST* child : children) {
+    if (child->type == REPEATED_CHAR_LL) {
+      const LiteralLength& length = state.layout->nodes[child->nodeIndex].length;
+      if (length.shares && length.value > 0) {
+        return;
+      }
+    } else if (child->type == REPEATED_CHAR_FL) {
+      const RepeatedCharFL* rcFL = static_cast<const RepeatedCharFL*>(child);
+      if (rcFL->length.shares && getFunctionLength(state, ccState, k, rcFL->length, rcFL->f_at, lineNum) > 0) {
+        return;
+      }
+      ++k;
+    }
+  }
+  throw DSLException(srcBlock->f_at, "No share-length content to distribute remaining length to.");
+}
+
+void ConsistentContent::generateCCLine(const RenderState& state, int lineNum, CCState* ccState, CCLine* line) const {
   int totalLength = endCol - startCol;
-  std::vector<FillerPtr>* lineContents = &line->contents;
-  lineContents->clear();
+  int maxWordsLength = (words != NULL) ? getMaxWordsLength(state, ccState, lineNum) : 0;
+  TextVector<CCSegment>& segments = line->segments;
+  segments.clear();
 
-  // add the non-word contents of this CC, with any function lengths evaluated to literal length
-  for (const ASTPtr& child : children) {
+  // Add the contents of this CC in order, with any function lengths evaluated to literal length,
+  // and as much of the word source as fits on this line where the Words child is.
+  int wordsBegin = 0, wordsEnd = 0;
+  int k = 0;  // function lengths so far
+  for (const AST* child : children) {
     switch (child->type) {
     case STRING_LITERAL: {
-      const StringLiteral* sl = static_cast<const StringLiteral*>(child.get());
-      lineContents->push_back(FillerPtr(new StringLiteral(*sl)));
-      // deep copy of StringLiteral not really needed for our purposes, but do it anyway in case
-      //lineContents->push_back(std::static_pointer_cast<Filler>(child));
+      const StringLiteral* sl = static_cast<const StringLiteral*>(child);
+      segments.push_back(charsSegment(sl->str.data(), sl->str.length()));
     } break;
     case REPEATED_CHAR_LL: {
-      const RepeatedCharLL* rcLL = static_cast<const RepeatedCharLL*>(child.get());
-      lineContents->push_back(FillerPtr(new RepeatedCharLL(*rcLL)));
+      const RepeatedCharLL* rcLL = static_cast<const RepeatedCharLL*>(child);
+      segments.push_back(fillSegment(rcLL->c, state.layout->nodes[rcLL->nodeIndex].length));
     } break;
     case REPEATED_CHAR_FL: {
-      const RepeatedCharFL* rcFL = static_cast<const RepeatedCharFL*>(child.get());
-      lineContents->push_back(rcFL->toRepeatedCharLL(lineNum));
+      const RepeatedCharFL* rcFL = static_cast<const RepeatedCharFL*>(child);
+      int length = getFunctionLength(state, ccState, k, rcFL->length, rcFL->f_at, lineNum);
+      segments.push_back(fillSegment(rcFL->c, LiteralLength(length, rcFL->length.shares)));
+      ++k;
+    } break;
+    case WORDS: {
+      int maxNumWords = INT_MAX;
+      if (words->balanced) {
+        BalancedBreaks& breaks = ccState->balancedBreaks;
+        if (breaks.nextLine == breaks.lineNumWords.size()) {
+          breaks.breakParagraph(ccState->s_at, interwordFixedLength, maxWordsLength);
+        }
+        maxNumWords = breaks.lineNumWords[breaks.nextLine++];
+      }
+      wordsBegin = segments.size();
+      ccState->s_at = wordsLineToSegments(*words, ccState->s_at, interwordFixedLength, maxWordsLength,
+                                          maxNumWords, &segments);
+      wordsEnd = segments.size();
+      int segmentsPerWord = words->interwordFillers.size() + 1;   // a word and the fillers before it
+      ccState->numWordsPlaced += (wordsEnd - wordsBegin + segmentsPerWord - 1) / segmentsPerWord;
     } break;
-    case WORDS:
-      break;
     default:
       assert(false);
     }
   }
-  // If this CC has no line-varying content, we've done all we needed to do
+  // If this CC has no line-varying content, its lengths were all fixed by the layout
   if (childrenConsistent && words == NULL) {
     return;
   }
 
-  // If this CC has words, insert additional content into lineContents at the wordsIndex that represent
-  // the words.
-  if (words != NULL) {
-    int maxWordsLength = totalLength;
-    for (const FillerPtr& lineContent : *lineContents) {
-      if (!lineContent->length.shares) {
-        maxWordsLength -= lineContent->length.value;
-      }
-    }
-    if (maxWordsLength <= 0) {
-      throw DSLException(words->f_at, "No length remaining for words.");
-    }
-
-    // Convert source text into contents (StringLiterals for words, Fillers for interwords).
-    // Convert as much of the source as can fit in this line.
-    std::vector<FillerPtr> wordsContents;
-    s_at = wordsLineToContents(*words, s_at, interwordFixedLength, maxWordsLength, &wordsContents);
-    // If the resulting wordsContents has any shares, then distribute any unused words length to them.
-    // If the interword fillers have shares and more than 1 word from the source was put in wordsContent,
-    // the wordsContents has shares.
-    if (interwordHasShares && wordsContents.size() > 1) {
-      std::vector<LiteralLength*> lls;
-      for (const FillerPtr& filler : wordsContents) {
-        lls.push_back(&filler->length);
-      }
-      llSharesToLength(maxWordsLength, lls, words->f_at);
+  // If the words have shares, then distribute any unused words length to them. If the interword
+  // fillers have shares and more than 1 word from the source was put on this line, the words have
+  // shares.
+  if (interwordHasShares && wordsEnd - wordsBegin > 1) {
+    ++ccState->numShareDistributions;
+    if (interwordPlan.compiled) {
+      CCSegment* begin = segments.data() + wordsBegin;
+      CCSegment* end = segments.data() + wordsEnd;
+      int numShareSegments;
+      int lengthRemaining = shareLengthRemaining(maxWordsLength, begin, end, &numShareSegments, words->f_at);
+      interwordPlan.distribute(lengthRemaining, numShareSegments / interwordPlan.shares.size(), begin, end);
+    } else {
+      llSharesToLength(maxWordsLength, segments.begin() + wordsBegin, segments.begin() + wordsEnd, words->f_at);
     }
-
-    // Insert the converted words contents into the line contents at the index where the Words child
-    // is.
-    lineContents->insert(lineContents->begin() + wordsIndex, wordsContents.begin(), wordsContents.end());
   }
 
   // Compute the share lengths of the line contents
-  std::vector<LiteralLength*> lls;
-  for (const FillerPtr& filler : *lineContents) {
-    lls.push_back(&filler->length);
+  ++ccState->numShareDistributions;
+  if (linePlan.compiled) {
+    CCSegment* begin = segments.data();
+    CCSegment* end = segments.data() + segments.size();
+    int numShareSegments;
+    int lengthRemaining = shareLengthRemaining(totalLength, begin, end, &numShareSegments, srcBlock->f_at);
+    linePlan.distribute(lengthRemaining, 1, begin, end);
+  } else {
+    llSharesToLength(totalLength, segments.begin(), segments.end(), srcBlock->f_at);
   }
-  llSharesToLength(totalLength, lls, srcAst->f_at);
 }
 
-void ConsistentContent::generateCCLines() {
+void ConsistentContent::compileLinePlan(const Layout& layout) {
+  linePlan.shares.clear();
+  linePlan.compiled = false;
+  if (childrenConsistent && words == NULL) {
+    return;
+  }
+  // Once the words are laid out, the only shares left on a line are those of these children.
+  for (const AST* child : children) {
+    if (child->type == REPEATED_CHAR_LL) {
+      const LiteralLength& length = layout.nodes[child->nodeIndex].length;
+      if (length.shares) {
+        linePlan.shares.push_back(length.value);
+      }
+    } else if (child->type == REPEATED_CHAR_FL) {
+      if (static_cast<const RepeatedCharFL*>(child)->length.shares) {
+        return;
+      }
+    }
+  }
+  compileIfShares(&linePlan);
+}
+
+void ConsistentContent::generateCCLines(RenderState* state, CCState* ccState) const {
+  TextVector<CCLine>& lines = ccState->lines;
   lines.clear();
   if (words != NULL) {
-    // initialize s_at to beginning of source; compute interwordHasShares and interwordFixedLength
-    s_at = words->source.c_str();
-    interwordFixedLength = 0;
-    interwordHasShares = false;
-    for (const FillerPtr& filler : words->interwordFillers) {
-      if (!filler->length.shares) {
-        interwordFixedLength += filler->length.value;
-      } else {
-        interwordHasShares = true;
-      }
+    // initialize s_at to beginning of source
+    ccState->s_at = getWordSource(*state);
+    ccState->balancedBreaks.reset();
+    if (words->balanced) {
+      getBalancedWordsLength(*state, ccState);
     }
     // do-while instead of while; if source is empty str, then a blank line is still inserted.
     // This ensures at least one CCLine is created.
+    // Lines are built in the reused scratch line and then copied at their exact size.
     do {
-      lines.push_back(CCLine());
-      generateCCLine(lines.size() - 1, &lines.back());
-     } while (*s_at != '\0');
-     srcAst->numContentLines = lines.size();  // each block has at most one CC with Words
+      generateCCLine(*state, lines.size(), ccState, &ccState->scratchLine);
+      lines.push_back(ccState->scratchLine);
+     } while (*ccState->s_at != '\0');
+     state->blocks[blockIndex].numContentLines = lines.size();  // each block has at most one CC with Words
   } else {
-    lines.push_back(CCLine());
-    generateCCLine(UNKNOWN_COL, &lines.back());
+    // Without Words, a CC has one line, shown on each of its content lines, so its '#' lengths are
+    // those of line 0
+    lines.push_back(CCLine(lines.get_allocator().resource));
+    generateCCLine(*state, 0, ccState, &lines.back());
+  }
+  ccState->firstLineNum = 0;
+}
+
+int ConsistentContent::countCCLines(const RenderState& state, CCState* ccState, int checkpointInterval,
+                                   TextVector<CCCheckpoint>* checkpoints) const {
+  assert(words != NULL);
+  assert(checkpoints == NULL || (checkpointInterval > 0 && checkpoints->empty()));
+  const char* s_at = getWordSource(state);
+  int numLines = 0;
+  if (words->balanced) {
+    int lineMaxLength = getBalancedWordsLength(state, ccState);
+    BalancedBreaks breaks(state.resource);
+    do {
+      if (checkpoints != NULL &&
+          (checkpoints->empty() || numLines - checkpoints->back().lineNum >= checkpointInterval)) {
+        CCCheckpoint checkpoint = { numLines, s_at };
+        checkpoints->push_back(checkpoint);
+      }
+      s_at = breaks.breakParagraph(s_at, interwordFixedLength, lineMaxLength);
+      int piece = 0;  // first piece of the line; ends has one more than the paragraph's pieces
+      for (int lineNumWords : breaks.lineNumWords) {
+        int nextPiece = std::min(piece + lineNumWords, (int)breaks.ends.size() - 1);
+        int usedLength = std::max((int)(breaks.ends[nextPiece] - breaks.ends[piece]) - interwordFixedLength, 0);
+        checkLineShares(state, ccState, numLines++, lineMaxLength, usedLength, lineNumWords);
+        piece = nextPiece;
+      }
+    } while (*s_at != '\0');
+    return numLines;
   }
+  do {
+    if (checkpoints != NULL && numLines % checkpointInterval == 0) {
+      CCCheckpoint checkpoint = { numLines, s_at };
+      checkpoints->push_back(checkpoint);
+    }
+    int lineMaxLength = getMaxWordsLength(state, ccState, numLines);
+    int usedLength = -interwordFixedLength;
+    int numWords = 0;
+    s_at = wrapWordsLine(s_at, interwordFixedLength, lineMaxLength, INT_MAX, [&](const char* word, int wordLength) {
+      usedLength += interwordFixedLength + wordLength;
+      ++numWords;
+    });
+    checkLineShares(state, ccState, numLines, lineMaxLength, usedLength, numWords);
+    ++numLines;
+  } while (*s_at != '\0');
+  return numLines;
 }
 
-void AST::computeNumContentLines() {
-  numContentLines = 1;
-  numFixedLines = 1;
+// Each line takes the first word, or as much of it as fits, then as many more words as fit, up to
+// and including a '\n': the lines of wrapWordsLine, with firstWordDone standing for a pointer into
+// a word longer than a line.
+int ConsistentContent::countCCLines(const RenderState& state, CCState* ccState, const WordLengths& wordLengths) const {
+  assert(words != NULL && !words->balanced);
+  const int* at = wordLengths.lengths.data();
+  const int* end = at + wordLengths.lengths.size();
+  int firstWordDone = 0;  // length of *at already on previous lines
+  int numLines = 0;
+  do {
+    int lineMaxLength = getMaxWordsLength(state, ccState, numLines);
+    ++numLines;
+    int firstWordLength = (at == end || *at == WORD_LENGTHS_NEWLINE) ? 0 : *at - firstWordDone;
+    if (firstWordLength > lineMaxLength) {
+      firstWordDone += lineMaxLength;
+      continue;   // the line is full
+    }
+    if (at != end && *at != WORD_LENGTHS_NEWLINE) {
+      ++at;
+    }
+    firstWordDone = 0;
+    int remainingLength = lineMaxLength - firstWordLength;
+    int numWords = 1;
+    while (at != end) {
+      if (*at == WORD_LENGTHS_NEWLINE) {
+        ++at;
+        break;
+      } else if (interwordFixedLength + *at > remainingLength) {
+        break;
+      }
+      remainingLength -= interwordFixedLength + *at;
+      ++numWords;
+      ++at;
+    }
+    checkLineShares(state, ccState, numLines - 1, lineMaxLength, lineMaxLength - remainingLength, numWords);
+  } while (at != end || firstWordDone > 0);
+  return numLines;
 }
 
-void Block::computeNumContentLines() {
+void WordLengths::scan(const char* s_at) {
+  source = s_at;
+  lengths.clear();
+  while (true) {
+    s_at = parseWhitespacesExceptNewline(s_at);
+    if (*s_at == '\0') {
+      break;
+    } else if (*s_at == '\n') {
+      lengths.push_back(WORD_LENGTHS_NEWLINE);
+      ++s_at;
+    } else {
+      const char* wordEnd = parseUntilWhitespace(s_at);
+      lengths.push_back((int)(wordEnd - s_at));
+      s_at = wordEnd;
+    }
+  }
+  // Whitespace after the last '\n' wraps to one more, empty line: an empty word stands for it
+  if (!lengths.empty() && lengths.back() == WORD_LENGTHS_NEWLINE && s_at[-1] != '\n') {
+    lengths.push_back(0);
+  }
+}
+
+void ConsistentContent::startStreamingCCLines(const RenderState& state, CCState* ccState) const {
+  assert(words != NULL);
+  ccState->s_at = getWordSource(state);
+  ccState->lines.clear();
+  ccState->firstLineNum = 0;
+  ccState->balancedBreaks.reset();
+}
+
+// The last checkpoint at or before lineNum; checkpoints start with line 0.
+static const CCCheckpoint& findCheckpoint(const TextVector<CCCheckpoint>& checkpoints, int lineNum) {
+  int lo = 0, hi = checkpoints.size() - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (checkpoints[mid].lineNum <= lineNum) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return checkpoints[lo];
+}
+
+void ConsistentContent::streamCCLine(const RenderState& state, int lineNum, CCState* ccState) const {
+  assert(words != NULL);
+  lineNum -= ccState->topFillersChars.length();
+  if (lineNum < 0 || lineNum >= state.blocks[blockIndex].numContentLines) {
+    return;
+  }
+  const TextVector<CCCheckpoint>& checkpoints = ccState->checkpoints;
+  if (!checkpoints.empty()) {
+    const CCCheckpoint& checkpoint = findCheckpoint(checkpoints, lineNum);
+    if (ccState->lines.empty() || lineNum < ccState->firstLineNum || checkpoint.lineNum > ccState->firstLineNum) {
+      ccState->s_at = checkpoint.s_at;
+      ccState->balancedBreaks.reset();
+      if (ccState->lines.empty()) {
+        ccState->lines.push_back(CCLine(ccState->lines.get_allocator().resource));
+      }
+      ccState->firstLineNum = checkpoint.lineNum;
+      generateCCLine(state, checkpoint.lineNum, ccState, &ccState->lines[0]);
+    }
+  }
+  if (ccState->lines.empty()) {
+    ccState->lines.push_back(CCLine(ccState->lines.get_allocator().resource));
+    generateCCLine(state, 0, ccState, &ccState->lines[0]);
+  }
+  assert(lineNum >= ccState->firstLineNum);
+  while (ccState->firstLineNum < lineNum) {
+    ++ccState->firstLineNum;
+    generateCCLine(state, ccState->firstLineNum, ccState, &ccState->lines[0]);
+  }
+}
+
+void AST::computeNumContentLines(RenderState* state) const {
+}
+
+int AST::getNumFixedLines(const RenderState& state) const {
+  return 1;
+}
+
+void Block::computeNumContentLines(RenderState* state) const {
   for (const ASTPtr& child : children) {
-    child->computeNumContentLines();
+    child->computeNumContentLines(state);
   }
+  BlockState& blockState = state->blocks[blockIndex];
   if (hasWords()) {
     // If this block has Words, numContentLines should have been set by generateCCLines()
-    assert(numContentLines != UNKNOWN_COL);
+    assert(blockState.numContentLines != UNKNOWN_COL);
   } else {
     // num content lines of a block is the max of the fixed lengths of its children (i.e. the min
     // number of lines necessary to display all its children with vertical fillers)
-    numContentLines = 0;
+    blockState.numContentLines = 0;
     for (const ASTPtr& child : children) {
-      if (child->numFixedLines > numContentLines) {
-        numContentLines = child->numFixedLines;
+      int childNumFixedLines = child->getNumFixedLines(*state);
+      if (childNumFixedLines > blockState.numContentLines) {
+        blockState.numContentLines = childNumFixedLines;
       }
     }
   }
   // Add up fixed-length content in vertical fillers to compute numFixedLines, which is the min
   // number of lines necessary to display this block with vertical fillers.
-  numFixedLines = numContentLines;
+  blockState.numFixedLines = blockState.numContentLines;
   for (const FillerPtr& filler : topFillers) {
     if (!filler->length.shares) {
-      numFixedLines += filler->length.value;
+      blockState.numFixedLines += filler->length.value;
     }
   }
   for (const FillerPtr& filler : bottomFillers) {
     if (!filler->length.shares) {
-      numFixedLines += filler->length.value;
+      blockState.numFixedLines += filler->length.value;
     }
   }
 }
 
-void AST::computeNumTotalLines(bool isRoot) {
-  if (isRoot) {
-    numTotalLines = numFixedLines;
-  }
+int Block::getNumFixedLines(const RenderState& state) const {
+  return state.blocks[blockIndex].numFixedLines;
 }
 
-void Block::computeNumTotalLines(bool isRoot) {
-  if (isRoot) {
-    numTotalLines = numFixedLines;
-  }
+void AST::computeNumTotalLines(RenderState* state, int numTotalLines) const {
+}
+
+void Block::computeNumTotalLines(RenderState* state, int numTotalLines) const {
+  BlockState& blockState = state->blocks[blockIndex];
+  blockState.numTotalLines = numTotalLines;
   for (const ASTPtr& child : children) {
-    child->numTotalLines = numContentLines;
-    child->computeNumTotalLines(false);
+    child->computeNumTotalLines(state, blockState.numContentLines);
   }
 }
 
-void AST::computeBlockVerticalFillersShares() {
+void AST::computeBlockVerticalFillersShares(RenderState* state) const {
 }
 
-void Block::computeBlockVerticalFillersShares() {
-  assert(numContentLines != UNKNOWN_COL);
-  assert(numFixedLines != UNKNOWN_COL);
-  assert(numTotalLines != UNKNOWN_COL);
-  std::vector<LiteralLength*> lls;
+void Block::computeBlockVerticalFillersShares(RenderState* state) const {
+  BlockState& blockState = state->blocks[blockIndex];
+  assert(blockState.numContentLines != UNKNOWN_COL);
+  assert(blockState.numFixedLines != UNKNOWN_COL);
+  assert(blockState.numTotalLines != UNKNOWN_COL);
+  // Distribute shares among copies of the filler lengths; the fillers belong to the template.
+  TextVector<LiteralLength> lengths(TextAllocator<LiteralLength>(state->resource));
   for (const FillerPtr& filler : topFillers) {
-    lls.push_back(&filler->length);
+    lengths.push_back(filler->length);
   }
-  LiteralLength contentLines(numContentLines, false);
-  lls.push_back(&contentLines);
+  lengths.push_back(LiteralLength(blockState.numContentLines, false));
   for (const FillerPtr& filler : bottomFillers) {
-    lls.push_back(&filler->length);
+    lengths.push_back(filler->length);
+  }
+  TextVector<LiteralLength*> lls(TextAllocator<LiteralLength*>(state->resource));
+  for (LiteralLength& length : lengths) {
+    lls.push_back(&length);
+  }
+  llSharesToLength(blockState.numTotalLines, lls.begin(), lls.end(), f_at);
+  if (state->stats != NULL) {
+    ++state->stats->numShareDistributions;
+  }
+  blockState.topFillersNumLines.resize(topFillers.size());
+  for (int i = 0; i < topFillers.size(); ++i) {
+    blockState.topFillersNumLines[i] = lengths[i].value;
+  }
+  blockState.bottomFillersNumLines.resize(bottomFillers.size());
+  for (int i = 0; i < bottomFillers.size(); ++i) {
+    blockState.bottomFillersNumLines[i] = lengths[topFillers.size() + 1 + i].value;
   }
-  llSharesToLength(numTotalLines, lls, f_at);
 
   for (const ASTPtr& child : children) {
-    child->computeBlockVerticalFillersShares();
+    child->computeBlockVerticalFillersShares(state);
   }
 }
 
 
-static void verticalFillersToLinesChars(const std::vector<FillerPtr>& fillers, std::string* linesChars) {
-  linesChars->clear();
-  for (const FillerPtr& filler : fillers) {
-    assert(!filler->length.shares);
+static void verticalFillersToLinesChars(const std::vector<FillerPtr>& fillers, const TextVector<int>& numLines,
+                                        TextString* linesChars) {
+  assert(numLines.size() == fillers.size());
+  for (int i = 0; i < fillers.size(); ++i) {
+    const FillerPtr& filler = fillers[i];
     if (filler->type == REPEATED_CHAR_LL) {
       const RepeatedCharLL* rcLL = static_cast<const RepeatedCharLL*>(filler.get());
       int oldSize = linesChars->length();
-      linesChars->resize(linesChars->length() + rcLL->length.value);
-      memset(&(*linesChars)[oldSize], rcLL->c, rcLL->length.value);
+      linesChars->resize(linesChars->length() + numLines[i]);
+      memset(&(*linesChars)[oldSize], rcLL->c, numLines[i]);
     } else {
       const StringLiteral* sl = static_cast<const StringLiteral*>(filler.get());
-      *linesChars += sl->str;
+      linesChars->append(sl->str.data(), sl->str.length());
     }
   }
 }
 
-void ConsistentContent::generateLinesChars(int rootNumTotalLines) {
-  verticalFillersToLinesChars(topFillers, &topFillersChars);
-  verticalFillersToLinesChars(bottomFillers, &bottomFillersChars);
-  assert(topFillersChars.length() + srcAst->numContentLines + bottomFillersChars.length() == rootNumTotalLines);
+void ConsistentContent::generateLinesChars(const RenderState& state, CCState* ccState) const {
+  ccState->topFillersChars.clear();
+  for (const Block* block : blocks) {
+    verticalFillersToLinesChars(block->topFillers, state.blocks[block->blockIndex].topFillersNumLines,
+                                &ccState->topFillersChars);
+  }
+  ccState->bottomFillersChars.clear();
+  for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+    verticalFillersToLinesChars((*it)->bottomFillers, state.blocks[(*it)->blockIndex].bottomFillersNumLines,
+                                &ccState->bottomFillersChars);
+  }
+  assert(ccState->topFillersChars.length() + state.blocks[blockIndex].numContentLines
+         + ccState->bottomFillersChars.length() == state.numTotalLines);
 }
 
 
 
-void ConsistentContent::printContentLine(FILE* stream, int lineNum, int rootNumTotalLines) {
-  assert(0 <= lineNum && lineNum < rootNumTotalLines);
-  if (lineNum < topFillersChars.length()) {
-    putChars(stream, topFillersChars[lineNum], endCol - startCol);
+void ConsistentContent::printContentLine(FILE* stream, const RenderState& state, const CCState& ccState,
+                                         int lineNum) const {
+  assert(0 <= lineNum && lineNum < state.numTotalLines);
+  int numContentLines = state.blocks[blockIndex].numContentLines;
+  if (lineNum < ccState.topFillersChars.length()) {
+    putChars(stream, ccState.topFillersChars[lineNum], endCol - startCol);
   } else {
-    lineNum -= topFillersChars.length();
-    if (lineNum < srcAst->numContentLines) {
+    lineNum -= ccState.topFillersChars.length();
+    if (lineNum < numContentLines) {
       if (words != NULL) {
-        lines[lineNum].printContent(stream);
+        ccState.lines[lineNum - ccState.firstLineNum].printContent(stream);
       } else {
-        lines[0].printContent(stream);
+        ccState.lines[0].printContent(stream);
       }
     } else {
-      lineNum -= srcAst->numContentLines;
-      putChars(stream, bottomFillersChars[lineNum], endCol - startCol);
+      lineNum -= numContentLines;
+      putChars(stream, ccState.bottomFillersChars[lineNum], endCol - startCol);
     }
   }
 }
-void ConsistentContent::printContentLine(char** bufAt, int lineNum, int rootNumTotalLines) {
-  assert(0 <= lineNum && lineNum < rootNumTotalLines);
-  if (lineNum < topFillersChars.length()) {
-    putChars(bufAt, topFillersChars[lineNum], endCol - startCol);
+void ConsistentContent::printContentLine(char** bufAt, const RenderState& state, const CCState& ccState,
+                                         int lineNum) const {
+  assert(0 <= lineNum && lineNum < state.numTotalLines);
+  int numContentLines = state.blocks[blockIndex].numContentLines;
+  if (lineNum < ccState.topFillersChars.length()) {
+    putChars(bufAt, ccState.topFillersChars[lineNum], endCol - startCol);
   } else {
-    lineNum -= topFillersChars.length();
-    if (lineNum < srcAst->numContentLines) {
+    lineNum -= ccState.topFillersChars.length();
+    if (lineNum < numContentLines) {
       if (words != NULL) {
-        lines[lineNum].printContent(bufAt);
+        ccState.lines[lineNum - ccState.firstLineNum].printContent(bufAt);
       } else {
-        lines[0].printContent(bufAt);
+        ccState.lines[0].printContent(bufAt);
       }
     } else {
-      lineNum -= srcAst->numContentLines;
-      putChars(bufAt, bottomFillersChars[lineNum], endCol - startCol);
+      lineNum -= numContentLines;
+      putChars(bufAt, ccState.bottomFillersChars[lineNum], endCol - startCol);
     }
   }
 }
@@ -5,16 +5,72 @@
 #include <memory>
 #include <assert.h>
 #include <exception>
+#include <string>
+
+#include "arena.h"
 
 const int UNKNOWN_COL = -1;
+const int RENDER_WIDTH = -2;  // value of the literal length '*', which takes the width passed to render
+const int ARG_LENGTH = -3;    // value of the literal length '$', which takes a length argument of the render
+// Takes the content line number, from 0. A '#' length outside of a block with Words has one length,
+// that of line 0.
 typedef int(*LengthFunc)(int);
 
+// Fills lengths[0, lineEnd - lineBegin) with the lengths of lines [lineBegin, lineEnd).
+typedef void(*TextLengthRangeFunc)(int lineBegin, int lineEnd, int* lengths, void* context);
+
+// Where the lengths of a '#' length come from, bound at render time in place of a LengthFunc: a
+// LengthFunc, a TextLengthRangeFunc called with context for TEXT_LENGTH_FILL_LINES lines at a time,
+// or an array of lengths precomputed for lines [0, numLengths). A render asks for a line's length
+// once however many times the line is wrapped, and again only if it wraps the line once more, like
+// a stream does after counting its lines. Lengths must not be negative.
+struct TextLengthSource {
+  TextLengthSource(LengthFunc func)
+    : func(func), rangeFunc(NULL), context(NULL), lengths(NULL), numLengths(0) {}
+  TextLengthSource(TextLengthRangeFunc rangeFunc, void* context)
+    : func(NULL), rangeFunc(rangeFunc), context(context), lengths(NULL), numLengths(0) {}
+  TextLengthSource(const int* lengths, int numLengths)
+    : func(NULL), rangeFunc(NULL), context(NULL), lengths(lengths), numLengths(numLengths) {}
+
+  LengthFunc func;
+  TextLengthRangeFunc rangeFunc;
+  void* context;
+  const int* lengths;
+  int numLengths;
+};
+
+// One TextLengthSource for each '#' length of a format, in order of appearance
+struct TextLengthSources {
+  TextLengthSources(const TextLengthSource* sources, int numSources) : sources(sources), numSources(numSources) {}
+
+  const TextLengthSource* sources;
+  int numSources;
+};
+
+const int TEXT_LENGTH_FILL_LINES = 64;
+
 class DSLException : public std::exception {
 public:
   class DSLException(const char* f_at, const char* const& what)
-    : std::exception(what), f_at(f_at) {}
+    : std::exception(what), f_at(f_at), message(what) {}
 
   const char* f_at;
+  const char* message;  // the static string what() copies, which outlives the exception
+};
+
+// The first error of a pass that reports errors instead of throwing them; message is NULL until set.
+// message is always a string literal, so a DSLError never owns memory.
+struct DSLError {
+  DSLError() : f_at(NULL), message(NULL) {}
+  void set(const char* at, const char* what) {
+    if (message == NULL) {
+      f_at = at;
+      message = what;
+    }
+  }
+
+  const char* f_at;
+  const char* message;
 };
 
 // -------------------------------------------------------------------------------------------------
@@ -27,20 +83,20 @@ struct Length {
 };
 
 struct LiteralLength : public Length {
-  LiteralLength(int value, bool shares)
-    : Length(shares), value(value) {}
+  LiteralLength(int value, bool shares, int argIndex = -1)
+    : Length(shares), value(value), argIndex(argIndex) {}
   void print() const override;
 
   int value;
+  int argIndex;     // for ARG_LENGTH, the index of its argument
 };
 
 struct FunctionLength : public Length {
-  FunctionLength(LengthFunc lengthFunc, bool shares)
-    : Length(shares), lengthFunc(lengthFunc) {}
+  FunctionLength(int funcIndex, bool shares)
+    : Length(shares), funcIndex(funcIndex) {}
   void print() const override;
-  LiteralLength toLiteralLength(int line) const { return LiteralLength((*lengthFunc)(line), shares); }
 
-  LengthFunc lengthFunc;
+  int funcIndex;    // index into the length funcs or sources bound at render time
 };
 
 // -------------------------------------------------------------------------------------------------
@@ -50,38 +106,40 @@ class Visitor;
 struct ConsistentContent;
 struct AST;
 struct Filler;
+struct Block;
+struct Layout;
+struct RenderState;
 
 typedef std::shared_ptr<AST> ASTPtr;
 typedef std::shared_ptr<Filler> FillerPtr;
 
 struct AST {
   AST(NodeType type, const char* f_at)
-    : type(type), f_at(f_at), startCol(UNKNOWN_COL), endCol(UNKNOWN_COL),
-    numContentLines(UNKNOWN_COL), numFixedLines(UNKNOWN_COL), numTotalLines(UNKNOWN_COL) {}
+    : type(type), f_at(f_at), nodeIndex(-1) {}
   virtual void print() const = 0;
   virtual void accept(Visitor* v) = 0;
-  virtual int getFixedLength() const = 0;
-  virtual LiteralLength* getLiteralLength() = 0;
-
-  virtual void convertLLSharesToLength();
-  virtual void computeStartEndCols(int start, int end);
-  virtual void flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* ccs,
-    bool firstAfterBlockBoundary,
-    std::vector<FillerPtr>* topFillersStack, std::vector<FillerPtr>* bottomFillersStack);
-
-  virtual void computeNumContentLines();
-  virtual void computeNumTotalLines(bool isRoot);
-  virtual void computeBlockVerticalFillersShares();
+  virtual const LiteralLength* getLiteralLength() const = 0;   // as specified; NULL if not literal-length
+
+  // Lengths and columns depend on the render width, so they are computed into a Layout rather than
+  // the AST.
+  int getFixedLength(const Layout& layout) const;
+  LiteralLength* getLiteralLength(Layout* layout) const;
+  // Both stop at the first error, which they set in *error rather than throw.
+  virtual void convertLLSharesToLength(Layout* layout, DSLError* error) const;
+  virtual void computeStartEndCols(Layout* layout, int start, int end, DSLError* error) const;
+  virtual void flatten(const Block* parent, Layout* layout,
+    bool firstAfterBlockBoundary, TextVector<const Block*>* blocksStack) const;
+
+  // Line counts depend on the word sources, so they are computed into a RenderState rather than
+  // the AST; content other than blocks always spans exactly one line.
+  virtual void computeNumContentLines(RenderState* state) const;
+  virtual int getNumFixedLines(const RenderState& state) const;
+  virtual void computeNumTotalLines(RenderState* state, int numTotalLines) const;
+  virtual void computeBlockVerticalFillersShares(RenderState* state) const;
   
   NodeType type;
   const char* f_at;   // position in the format string where this node is specified
-
-  int startCol;     // starting column of this content
-  int endCol;       // ending column of this content (1 past last)
-
-  int numContentLines;    // number of lines of non-vertical-filler content (word lines for blocks, 1 otherwise)
-  int numFixedLines;      // minimum number of lines of this content (word lines + fixed filler lines) for blocks, 1 otherwise
-  int numTotalLines;      // number of lines including filler lines
+  int nodeIndex;      // index of this node's NodeLayout within a Layout
 };
 
 // -------------------------------------------------------------------------------------------------
@@ -89,10 +147,7 @@ struct AST {
 struct Filler : public AST {
   Filler(NodeType type, const char* f_at, const LiteralLength& length)
     : AST(type, f_at), length(length) {}
-  int getFixedLength() const override { return length.shares ? UNKNOWN_COL : length.value; }
-  LiteralLength* getLiteralLength() override { return &length; }
-  virtual void printContent(FILE* stream) const = 0;
-  virtual void printContent(char** bufAt) const = 0;
+  const LiteralLength* getLiteralLength() const override { return &length; }
 
   LiteralLength length;
 };
@@ -107,8 +162,6 @@ struct StringLiteral : public Filler {
     : Filler(STRING_LITERAL, f_at, LiteralLength(size, false)), str(src, size) {}
   void print() const override;
   void accept(Visitor* v) override;
-  void printContent(FILE* stream) const override;
-  void printContent(char** bufAt) const override;
 
   std::string str;
 };
@@ -118,8 +171,6 @@ struct RepeatedCharLL : public Filler {
     : Filler(REPEATED_CHAR_LL, f_at, length), c(c) {}
   void print() const override;
   void accept(Visitor* v) override;
-  void printContent(FILE* stream) const override;
-  void printContent(char** bufAt) const override;
 
   char c;
 };
@@ -131,49 +182,46 @@ struct RepeatedCharFL : public AST {
     : AST(REPEATED_CHAR_FL, f_at), length(length), c(c) {}
   void print() const override;
   void accept(Visitor* v) override;
-  int getFixedLength() const override { return UNKNOWN_COL; }
-  LiteralLength* getLiteralLength() override { return NULL; }
-
-  FillerPtr toRepeatedCharLL(int line) const;
+  const LiteralLength* getLiteralLength() const override { return NULL; }
 
   FunctionLength length;
   char c;
 };
 
 struct Words : public AST {
-  Words(const char* f_at, const std::string& source, char wordSilhouette = '\0')
-    : AST(WORDS, f_at), source(source), wordSilhouette(wordSilhouette) {}
+  Words(const char* f_at, int sourceIndex, char wordSilhouette = '\0')
+    : AST(WORDS, f_at), sourceIndex(sourceIndex), wordSilhouette(wordSilhouette), balanced(false) {}
   void print() const override;
   void accept(Visitor* v) override;
-  int getFixedLength() const override { return UNKNOWN_COL; }
-  LiteralLength* getLiteralLength() override { return NULL; }
+  const LiteralLength* getLiteralLength() const override { return NULL; }
 
-  std::string source;
+  int sourceIndex;   // index into the wordSources bound at render time
   std::vector<FillerPtr> interwordFillers;
   char wordSilhouette;        // use '\0' if unused
+  // {w= ...}: break each paragraph for minimum raggedness instead of filling each line greedily
+  bool balanced;
 };
 
 struct Block : public AST {
   Block(const char* f_at, const LiteralLength& length)
-    : AST(BLOCK, f_at), length(length), wordsIndex(-1), hasFLChild(false) {}
+    : AST(BLOCK, f_at), length(length), wordsIndex(-1), hasFLChild(false), blockIndex(-1) {}
   void print() const override;
   void accept(Visitor* v) override;
-  int getFixedLength() const override { return length.shares ? UNKNOWN_COL : length.value; }
-  LiteralLength* getLiteralLength() override { return &length; }
+  const LiteralLength* getLiteralLength() const override { return &length; }
 
-  void addChild(ASTPtr child);
-  void addWords(ASTPtr words);
+  void addChild(ASTPtr child, DSLError* error);   // set error if the child can't go in this block
+  void addWords(ASTPtr words, DSLError* error);
   bool hasWords() const;
 
-  void convertLLSharesToLength() override;
-  void computeStartEndCols(int start, int end) override;
-  void flatten(ASTPtr self, ASTPtr parent, std::vector<ConsistentContent>* ccs,
-    bool firstAfterBlockBoundary,
-    std::vector<FillerPtr>* topFillersStack, std::vector<FillerPtr>* bottomFillersStack) override;
+  void convertLLSharesToLength(Layout* layout, DSLError* error) const override;
+  void computeStartEndCols(Layout* layout, int start, int end, DSLError* error) const override;
+  void flatten(const Block* parent, Layout* layout,
+    bool firstAfterBlockBoundary, TextVector<const Block*>* blocksStack) const override;
 
-  void computeNumContentLines() override;
-  void computeNumTotalLines(bool isRoot) override;
-  void computeBlockVerticalFillersShares() override;
+  void computeNumContentLines(RenderState* state) const override;
+  int getNumFixedLines(const RenderState& state) const override;
+  void computeNumTotalLines(RenderState* state, int numTotalLines) const override;
+  void computeBlockVerticalFillersShares(RenderState* state) const override;
 
   LiteralLength length;
   std::vector<ASTPtr> children;
@@ -181,54 +229,292 @@ struct Block : public AST {
   bool hasFLChild;        // whether or not any children have function-length.
   std::vector<FillerPtr> topFillers;
   std::vector<FillerPtr> bottomFillers;
+  int blockIndex;   // index of this block's BlockState within a RenderState
 };
 
 typedef std::shared_ptr<Block> BlockPtr;
 
 // -------------------------------------------------------------------------------------------------
 struct CCLine;
+struct CCState;
+struct CCSegment;
+struct CCCheckpoint;
+struct WordLengths;
+
+// The distribution of a length over a fixed list of share counts, compiled once per layout so that
+// distributing each line's remaining length costs O(number of shares). Distributing
+// q * totalShares + r gives each share count s exactly s * q more than distributing r, so only the
+// distributions of r < totalShares are tabulated (unless the table would be too big).
+struct SharesPlan {
+  SharesPlan(TextMemoryResource* resource = NULL)
+    : compiled(false), totalShares(0), shares(TextAllocator<int>(resource)),
+    table(TextAllocator<int>(resource)) {}
+  void compile();   // after shares is filled in
+  // Sets the length of each share segment in [begin, end) from length. The segments' share counts
+  // are shares repeated numRepeats times, like the interword fillers between each pair of words.
+  void distribute(int length, int numRepeats, CCSegment* begin, CCSegment* end) const;
+
+  static const int MAX_TABLE_SIZE = 4096;
+
+  bool compiled;
+  int totalShares;
+  TextVector<int> shares;
+  TextVector<int> table;    // table[r * shares.size() + i] is shares[i]'s length when distributing r
+};
 
 // If one child, then child must be consistent.
 // If multiple children, then first and last children must be inconsistent
 struct ConsistentContent {
-  ConsistentContent(ASTPtr srcAst, bool childrenConsistent, int startCol, int endCol,
-    const std::vector<FillerPtr> topFillers, const std::vector<FillerPtr> bottomFillers)
-    : srcAst(srcAst), childrenConsistent(childrenConsistent),
-    wordsIndex(UNKNOWN_COL), words(NULL),
-    startCol(startCol), endCol(endCol), topFillers(topFillers), bottomFillers(bottomFillers),
-    s_at(NULL), interwordFixedLength(UNKNOWN_COL),
-    interwordHasShares(false) {}
+  ConsistentContent(const Block* srcBlock, bool childrenConsistent, int startCol, int endCol,
+    const TextVector<const Block*>& blocks)
+    : srcBlock(srcBlock), blockIndex(srcBlock->blockIndex),
+    childrenConsistent(childrenConsistent), children(blocks.get_allocator()), wordsIndex(UNKNOWN_COL), words(NULL),
+    startCol(startCol), endCol(endCol), blocks(blocks),
+    interwordFixedLength(UNKNOWN_COL), interwordHasShares(false),
+    interwordPlan(blocks.get_allocator().resource), linePlan(blocks.get_allocator().resource) {}
   void print() const;
 
-  void generateCCLine(int lineNum, CCLine* line);
-  void generateCCLines();
-
-  void generateLinesChars(int rootNumTotalLines);
-  void printContentLine(FILE* stream, int lineNum, int rootNumTotalLines);
-  void printContentLine(char** bufAt, int lineNum, int rootNumTotalLines);
-
-  ASTPtr srcAst;
+  // Compiles linePlan if the shares on this CC's lines are the same on every line, i.e. none of
+  // them are function lengths.
+  void compileLinePlan(const Layout& layout);
+
+  // The length of the kth function length among this CC's children on line lineNum, memoized in
+  // ccState while the render wraps the lines around it.
+  int getFunctionLength(const RenderState& state, CCState* ccState, int k, const FunctionLength& length,
+                        const char* f_at, int lineNum) const;
+  const char* getWordSource(const RenderState& state) const;   // throws if none was bound
+  int getMaxWordsLength(const RenderState& state, CCState* ccState, int lineNum) const;
+  int getBalancedWordsLength(const RenderState& state, CCState* ccState) const;   // throws unless line-independent
+  // Throws as generateCCLine would if a line of numWords words taking usedLength of maxWordsLength
+  // leaves a length that no share of the line can take
+  void checkLineShares(const RenderState& state, CCState* ccState, int lineNum, int maxWordsLength,
+                       int usedLength, int numWords) const;
+  void generateCCLine(const RenderState& state, int lineNum, CCState* ccState, CCLine* line) const;
+  void generateCCLines(RenderState* state, CCState* ccState) const;
+
+  // Streaming: the lines of Words are only counted up front, then generated one at a time, keeping
+  // only the current line in the CCState. streamCCLine generates the line shown on output line
+  // lineNum, if any, and must be called with increasing line numbers unless the count recorded
+  // checkpoints: then it starts over from the last checkpoint before lineNum whenever that is
+  // closer, so lines can be generated in any order.
+  int countCCLines(const RenderState& state, CCState* ccState, int checkpointInterval = 0,
+                   TextVector<CCCheckpoint>* checkpoints = NULL) const;
+  // The same from the scanned lengths of the words; greedy Words only
+  int countCCLines(const RenderState& state, CCState* ccState, const WordLengths& wordLengths) const;
+  void startStreamingCCLines(const RenderState& state, CCState* ccState) const;
+  void streamCCLine(const RenderState& state, int lineNum, CCState* ccState) const;
+
+  void generateLinesChars(const RenderState& state, CCState* ccState) const;
+  void printContentLine(FILE* stream, const RenderState& state, const CCState& ccState, int lineNum) const;
+  void printContentLine(char** bufAt, const RenderState& state, const CCState& ccState, int lineNum) const;
+
+  // Nodes are referenced by plain pointers: a Layout never outlives the template it belongs to.
+  const Block* srcBlock;
+  int blockIndex;   // srcBlock's blockIndex
   bool childrenConsistent;  // true if all children startCol and endCol are known (line-independent)
-  std::vector<ASTPtr> children;
+  TextVector<const AST*> children;
   int wordsIndex;
   const Words* words;
   int startCol;
   int endCol;
-  std::vector<FillerPtr> topFillers, bottomFillers;
+  TextVector<const Block*> blocks;    // enclosing blocks, outermost first; their vertical fillers frame this CC
 
-  const char* s_at;
   int interwordFixedLength;
   bool interwordHasShares;
-  std::vector<CCLine> lines;
-
-  std::string topFillersChars, bottomFillersChars;
+  SharesPlan interwordPlan;   // distributes unused words length to the interword fillers
+  SharesPlan linePlan;    // distributes the remaining length of each line to its shares
 };
 
 
+// One run of chars on a CCLine. Words and string literals are referenced in place, in the word
+// source or in the template, so building a line allocates nothing once its vector has grown.
+enum CCSegmentKind :char{ SEGMENT_CHARS, SEGMENT_FILL };
+
+struct CCSegment {
+  CCSegmentKind kind;
+  char c;               // the repeated char of a SEGMENT_FILL
+  bool shares;          // length is a share count until the line's shares are distributed
+  int length;
+  const char* chars;    // the chars of a SEGMENT_CHARS
+};
+
 struct CCLine {
-  void printContent(FILE* stream) const { for (const FillerPtr& c : contents) c->printContent(stream); }
-  void printContent(char** bufAt) const { for (const FillerPtr& c : contents) c->printContent(bufAt); }
-  std::vector<FillerPtr> contents;
+  CCLine(TextMemoryResource* resource = NULL) : segments(TextAllocator<CCSegment>(resource)) {}
+  void printContent(FILE* stream) const;
+  void printContent(char** bufAt) const;
+  TextVector<CCSegment> segments;
+};
+
+// -------------------------------------------------------------------------------------------------
+// Everything that depends on the render width lives in a Layout, and everything else a render
+// computes lives in a RenderState, so that the AST stays immutable once compiled and can be laid
+// out and rendered from any number of threads at once. A RenderState takes all of its memory from
+// the TextMemoryResource it is constructed with (the global heap if NULL).
+
+struct NodeLayout {
+  NodeLayout() : length(UNKNOWN_COL, false), startCol(UNKNOWN_COL), endCol(UNKNOWN_COL) {}
+
+  LiteralLength length;   // specified length with '*' and '$' resolved and line-independent shares distributed
+  int startCol;     // starting column of this content
+  int endCol;       // ending column of this content (1 past last)
+};
+
+struct Layout {
+  Layout(TextMemoryResource* resource = NULL)
+    : templateId(0), width(UNKNOWN_COL),
+    nodes(TextAllocator<NodeLayout>(resource)), ccs(TextAllocator<ConsistentContent>(resource)),
+    args(TextAllocator<int>(resource)), numCols(0),
+    numShareDistributions(0) {}
+
+  unsigned long long templateId;  // id of the TextTemplate this was laid out for; 0 if none
+  int width;                      // render width '*' lengths were resolved to
+  TextVector<NodeLayout> nodes;   // indexed by AST::nodeIndex
+  TextVector<ConsistentContent> ccs;
+  TextVector<int> args;           // values '$' lengths were resolved to, by argIndex
+  int numCols;
+  int numShareDistributions;      // of line-independent shares, for TextStats
+};
+
+struct BlockState {
+  BlockState(TextMemoryResource* resource = NULL)
+    : numContentLines(UNKNOWN_COL), numFixedLines(UNKNOWN_COL), numTotalLines(UNKNOWN_COL),
+    topFillersNumLines(TextAllocator<int>(resource)), bottomFillersNumLines(TextAllocator<int>(resource)) {}
+  void reset() {   // as constructed, keeping the vectors' memory for the next render
+    numContentLines = numFixedLines = numTotalLines = UNKNOWN_COL;
+    topFillersNumLines.clear();
+    bottomFillersNumLines.clear();
+  }
+
+  int numContentLines;    // number of lines of non-vertical-filler content (word lines, or max of children's numFixedLines)
+  int numFixedLines;      // minimum number of lines of this block (content lines + fixed filler lines)
+  int numTotalLines;      // number of lines including filler lines
+  TextVector<int> topFillersNumLines;      // line counts of the vertical fillers once their shares
+  TextVector<int> bottomFillersNumLines;   // are distributed
+};
+
+// Minimum-raggedness line breaks for balanced Words, one paragraph (up to a '\n') at a time: the
+// breaks minimize the sum of the squared unused lengths of all lines but the paragraph's last.
+// The words of a paragraph are broken into pieces as the greedy wrapping does (a word longer than a
+// line takes whole lines of it first), and a line of pieces [i, j) costs a convex function of
+// ends[j] - ends[i], so the best previous break only moves forward as j grows. Candidates are kept
+// in a queue, each with the first j it is best for, found by binary search: O(n log n) per
+// paragraph of n pieces. The scratch vectors are reused from one paragraph to the next.
+struct BalancedBreaks {
+  BalancedBreaks(TextMemoryResource* resource = NULL)
+    : lineNumWords(TextAllocator<int>(resource)), nextLine(0), ends(TextAllocator<long long>(resource)),
+    costs(TextAllocator<long long>(resource)), prevBreaks(TextAllocator<int>(resource)),
+    queueBreaks(TextAllocator<int>(resource)), queueStarts(TextAllocator<int>(resource)) {}
+
+  // Breaks the paragraph starting at s_at and returns where the next one starts.
+  const char* breakParagraph(const char* s_at, int interwordMinLength, int lineMaxLength);
+  void reset() { lineNumWords.clear(); nextLine = 0; }
+
+  TextVector<int> lineNumWords;   // number of pieces on each line of the current paragraph
+  int nextLine;                   // next line of the current paragraph to generate
+
+  TextVector<long long> ends;     // ends[k]: length of pieces [0, k) with an interword length after each
+  TextVector<long long> costs;    // costs[j]: least cost of the lines of pieces [0, j)
+  TextVector<int> prevBreaks;     // prevBreaks[j]: start of the last of those lines
+  TextVector<int> queueBreaks;
+  TextVector<int> queueStarts;
+};
+
+// Where a line of Words starts in its source. Checkpoints of greedy Words are every
+// checkpointInterval lines; balanced Words can only restart at a paragraph, so theirs are at the
+// first paragraph start at least checkpointInterval lines after the previous checkpoint.
+struct CCCheckpoint {
+  int lineNum;
+  const char* s_at;
+};
+
+// A word source reduced to the lengths of its words, with WORD_LENGTHS_NEWLINE for each '\n', so
+// its lines can be counted at any number of widths without scanning it again. Counting from the
+// lengths breaks lines exactly as counting from the source does.
+const int WORD_LENGTHS_NEWLINE = -1;
+
+struct WordLengths {
+  WordLengths(TextMemoryResource* resource = NULL) : source(NULL), lengths(TextAllocator<int>(resource)) {}
+  void scan(const char* s_at);
+
+  const char* source;   // the source scanned; NULL if none
+  TextVector<int> lengths;
+};
+
+// The lengths of a function length on the TEXT_LENGTH_FILL_LINES-aligned block of lines starting at
+// lineBase, UNKNOWN_COL where not asked for yet. Lines are wrapped in increasing order, from line 0
+// or a checkpoint, so one block is all a render needs, however long a stream or viewport is.
+struct FunctionLengthsMemo {
+  FunctionLengthsMemo(TextMemoryResource* resource = NULL) : lineBase(0), lengths(TextAllocator<int>(resource)) {}
+
+  int lineBase;
+  TextVector<int> lengths;   // empty until a length is asked for
+};
+
+struct CCState {
+  CCState(TextMemoryResource* resource = NULL)
+    : s_at(NULL), lines(TextAllocator<CCLine>(resource)), firstLineNum(0), scratchLine(resource),
+    topFillersChars(TextAllocator<char>(resource)), bottomFillersChars(TextAllocator<char>(resource)),
+    balancedBreaks(resource), checkpoints(TextAllocator<CCCheckpoint>(resource)),
+    funcLengths(TextAllocator<FunctionLengthsMemo>(resource)), numWordsPlaced(0), numShareDistributions(0) {}
+  void reset() {   // as constructed, keeping the vectors' memory for the next render
+    numWordsPlaced = numShareDistributions = 0;
+    s_at = NULL;
+    lines.clear();
+    firstLineNum = 0;
+    topFillersChars.clear();
+    bottomFillersChars.clear();
+    balancedBreaks.reset();
+    checkpoints.clear();
+    for (FunctionLengthsMemo& memo : funcLengths) {
+      memo.lengths.clear();
+    }
+  }
+
+  const char* s_at;
+  TextVector<CCLine> lines;
+  int firstLineNum;   // content line number of lines[0]; only nonzero while streaming
+  CCLine scratchLine;
+  TextString topFillersChars, bottomFillersChars;
+  BalancedBreaks balancedBreaks;  // breaks of the current paragraph of balanced Words
+  TextVector<CCCheckpoint> checkpoints;   // in increasing lineNum order; empty unless indexed
+  TextVector<FunctionLengthsMemo> funcLengths;   // of the kth function length among the CC's children
+  // Counted on every line, as that costs less than checking whether anyone wants them; see TextStats
+  long long numWordsPlaced;
+  long long numShareDistributions;
+};
+
+struct TextThreadPool;
+struct TextStats;
+struct TextArgs;
+
+// With a pool, the lines of the CCs are generated in parallel (calling any length funcs from the
+// pool's threads), each CC allocating through lockedResource.
+struct RenderState {
+  RenderState(TextMemoryResource* resource = NULL, TextThreadPool* pool = NULL)
+    : resource(resource), pool(pool), lockedResource(resource), layout(NULL),
+    wordSources(NULL), lengthFuncs(NULL), lengthSources(NULL), args(NULL), wordLengths(NULL),
+    ccs(TextAllocator<CCState>(resource)), blocks(TextAllocator<BlockState>(resource)),
+    scratchChars(TextAllocator<char>(resource)), numCols(0), numTotalLines(0), stats(NULL) {}
+
+  TextMemoryResource* resource;
+  TextThreadPool* pool;
+  TextLockedResource lockedResource;
+
+  const Layout* layout;     // the template's own layout, or sharedLayout for templates with '*' or '$' lengths
+  std::shared_ptr<const Layout> sharedLayout;   // from the template's layout cache; kept for the next render
+  const char** wordSources;
+  const LengthFunc* lengthFuncs;
+  const TextLengthSources* lengthSources;   // used instead of lengthFuncs if not NULL; set before rendering
+  const TextArgs* args;           // values of the template's '$' lengths; set before rendering
+  // Indexed by word source: TextTemplate::measure counts the lines of greedy Words from those
+  // scanned from their source, if any, instead of the source itself; set before measuring
+  const WordLengths* wordLengths;
+  TextVector<CCState> ccs;        // parallel to layout->ccs
+  TextVector<BlockState> blocks;  // indexed by Block::blockIndex
+  TextString scratchChars;        // a CC line to clip to a column range
+  int numCols;
+  int numTotalLines;
+  TextStats* stats;               // NULL unless the caller wants the render's counts and phase times
 };
 
 
@@ -0,0 +1,1202 @@
+#include "text.h"
+#include "template.h"
+#include "scan.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// gcc inlines the replaced deletes into delete expressions, then takes their free() for a mismatch
+// with the new expression; freeing out of line keeps it from seeing one.
+#if defined(__GNUC__) || defined(__clang__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+// Every allocation the process makes is counted, so benchmarks can report allocations per render.
+// All the global forms are replaced, so each delete frees what the matching new allocated.
+static atomic<long long> numAllocations(0);
+
+static void* countedMalloc(size_t size) throw() {
+  ++numAllocations;
+  return malloc(size > 0 ? size : 1);
+}
+
+static BENCH_NOINLINE void freeAllocation(void* p) throw() {
+  free(p);
+}
+
+void* operator new(size_t size) {
+  void* p = countedMalloc(size);
+  if (p == NULL) {
+    throw bad_alloc();
+  }
+  return p;
+}
+void* operator new[](size_t size) {
+  return operator new(size);
+}
+void* operator new(size_t size, const nothrow_t&) throw() {
+  return countedMalloc(size);
+}
+void* operator new[](size_t size, const nothrow_t&) throw() {
+  return countedMalloc(size);
+}
+void operator delete(void* p) throw() {
+  freeAllocation(p);
+}
+void operator delete[](void* p) throw() {
+  freeAllocation(p);
+}
+void operator delete(void* p, const nothrow_t&) throw() {
+  freeAllocation(p);
+}
+void operator delete[](void* p, const nothrow_t&) throw() {
+  freeAllocation(p);
+}
+void operator delete(void* p, size_t) throw() {
+  freeAllocation(p);
+}
+void operator delete[](void* p, size_t) throw() {
+  freeAllocation(p);
+}
+
+// Benchmarks that check a budget count their failures here; main returns 1 if there were any.
+static int numFailures = 0;
+
+static double secondsSince(Clock::time_point start) {
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Deterministic pseudo-random words of 1-12 letters separated by single spaces, with a newline
+// roughly every 80 words.
+static string makeCorpus(int numBytes, unsigned seed) {
+  string corpus;
+  corpus.reserve(numBytes);
+  unsigned x = seed;
+  int wordsSinceNewline = 0;
+  while ((int)corpus.size() < numBytes) {
+    x = x * 1664525u + 1013904223u;
+    int wordLength = 1 + (x >> 16) % 12;
+    for (int i = 0; i < wordLength; ++i) {
+      corpus += (char)('a' + (x >> (i % 24)) % 26);
+    }
+    if (++wordsSinceNewline == 80) {
+      corpus += '\n';
+      wordsSinceNewline = 0;
+    } else {
+      corpus += ' ';
+    }
+  }
+  corpus.resize(numBytes);
+  return corpus;
+}
+
+static void renderToString(const TextTemplate& tmpl, int width, const char** wordSources, RenderState* state, string* str) {
+  tmpl.render(state, width, wordSources, NULL);
+  str->resize((state->numCols + 1) * state->numTotalLines);
+  char* bufAt = &str->front();
+  for (int i = 0; i < state->numTotalLines; ++i) {
+    tmpl.printContentLine(&bufAt, *state, i);
+    *bufAt = '\n';
+    ++bufAt;
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Many threads render one shared template; since templates are immutable, throughput should scale
+// with the number of threads up to the number of cores.
+static void benchConcurrentRender() {
+  string s1 = makeCorpus(4096, 1), s2 = makeCorpus(4096, 2), s3 = makeCorpus(4096, 3);
+  const char* wordSources[3] = { s1.c_str(), s2.c_str(), s3.c_str() };
+  TextTemplatePtr tmpl = text_template_cache_get(
+    "*[' ' 1s[{w' '}1s' ']^{}v{1s'.'} ' | ' 1s[1s' '{w' '1s' '}]^{1s' ''='}v{'='1s' '} ' @ ' 1s[1s' '{w'::'}]^{1s' '}v{1s' '} ' ']");
+  const double secondsPerRun = 1.0;
+
+  int maxThreads = thread::hardware_concurrency();
+  if (maxThreads < 1) {
+    maxThreads = 1;
+  }
+  double singleThreadRate = 0.0;
+  for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2) {
+    atomic<bool> stop(false);
+    vector<long long> counts(numThreads, 0);
+    vector<thread> threads;
+    Clock::time_point start = Clock::now();
+    for (int t = 0; t < numThreads; ++t) {
+      threads.push_back(thread([&, t]() {
+        RenderState state;
+        string out;
+        long long count = 0;
+        while (!stop.load(memory_order_relaxed)) {
+          renderToString(*tmpl, 120, wordSources, &state, &out);
+          ++count;
+        }
+        counts[t] = count;
+      }));
+    }
+    this_thread::sleep_for(chrono::duration<double>(secondsPerRun));
+    stop = true;
+    for (thread& th : threads) {
+      th.join();
+    }
+    double elapsed = secondsSince(start);
+    long long total = 0;
+    for (long long count : counts) {
+      total += count;
+    }
+    double rate = total / elapsed;
+    if (numThreads == 1) {
+      singleThreadRate = rate;
+    }
+    printf("concurrent_render threads=%d renders/s=%.0f speedup=%.2f\n", numThreads, rate, rate / singleThreadRate);
+    if (numThreads < maxThreads && numThreads * 2 > maxThreads) {
+      numThreads = maxThreads / 2;  // always finish with maxThreads
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Renders a multi-megabyte source in full and as a stream. The stream should produce its first line
+// well before a full render finishes, and hold one CCLine per CC instead of one per line.
+static void benchStreaming() {
+  string source = makeCorpus(8 << 20, 4);
+  const char* wordSources[1] = { source.c_str() };
+  TextTemplatePtr tmpl = text_template_cache_get("*[' ' 1s[{w' '} 1s' '] ' ']");
+
+  Clock::time_point start = Clock::now();
+  RenderState state;
+  string full;
+  renderToString(*tmpl, 100, wordSources, &state, &full);
+  double fullSeconds = secondsSince(start);
+  size_t fullCCLines = 0;
+  for (const CCState& ccState : state.ccs) {
+    fullCCLines += ccState.lines.size();
+  }
+
+  start = Clock::now();
+  TextLineStream stream(*tmpl, 100, wordSources);
+  string line, streamed;
+  streamed.reserve(full.size());
+  double firstLineSeconds = 0.0;
+  size_t streamCCLines = 0;
+  while (stream.next(&line)) {
+    if (stream.lineNum == 1) {
+      firstLineSeconds = secondsSince(start);
+    }
+    for (const CCState& ccState : stream.state.ccs) {
+      streamCCLines = max(streamCCLines, ccState.lines.size());
+    }
+    streamed += line;
+    streamed += '\n';
+  }
+  double streamSeconds = secondsSince(start);
+
+  printf("streaming full_s=%.3f stream_first_line_s=%.3f stream_s=%.3f full_cc_lines=%llu stream_cc_lines=%llu identical=%d\n",
+         fullSeconds, firstLineSeconds, streamSeconds, (unsigned long long)fullCCLines, (unsigned long long)streamCCLines,
+         (int)(streamed == full));
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Renders a 10MB source, both with fixed interword fillers and justified, and reports the
+// allocations made per output line.
+static void benchLineAllocations() {
+  string source = makeCorpus(10 << 20, 5);
+  const char* wordSources[1] = { source.c_str() };
+  const char* formats[] = { "*[' ' 1s[{w' '} 1s' '] ' ']", "*[' ' 1s[{w 1s' '} 1s' '] ' ']" };
+  for (const char* format : formats) {
+    TextTemplatePtr tmpl = text_template_cache_get(format);
+    RenderState state;
+    string out;
+    long long allocationsBefore = numAllocations;
+    Clock::time_point start = Clock::now();
+    renderToString(*tmpl, 100, wordSources, &state, &out);
+    double seconds = secondsSince(start);
+    long long allocations = numAllocations - allocationsBefore;
+    printf("line_allocations format=\"%s\" lines=%d allocs=%lld allocs/line=%.2f s=%.3f\n",
+           format, state.numTotalLines, allocations, allocations / (double)state.numTotalLines, seconds);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Renders a small '*' template over and over with a fresh RenderState each time, as the text_*
+// entry points do, taking its memory from the heap and then from an arena that is reset after each
+// render.
+static void benchArenaRender() {
+  string s1 = makeCorpus(4096, 1), s2 = makeCorpus(4096, 2), s3 = makeCorpus(4096, 3);
+  const char* wordSources[3] = { s1.c_str(), s2.c_str(), s3.c_str() };
+  TextTemplatePtr tmpl = text_template_cache_get(
+    "*[' ' 1s[{w' '}1s' ']^{}v{1s'.'} ' | ' 1s[1s' '{w' '1s' '}]^{1s' ''='}v{'='1s' '} ' @ ' 1s[1s' '{w'::'}]^{1s' '}v{1s' '} ' ']");
+  const double secondsPerRun = 1.0;
+
+  TextArena arena;
+  string out;
+  for (int useArena = 0; useArena <= 1; ++useArena) {
+    long long renders = 0;
+    long long allocationsBefore = numAllocations;
+    Clock::time_point start = Clock::now();
+    while (secondsSince(start) < secondsPerRun) {
+      {
+        RenderState state(useArena ? &arena : NULL);
+        renderToString(*tmpl, 120, wordSources, &state, &out);
+      }
+      arena.reset();
+      ++renders;
+    }
+    double elapsed = secondsSince(start);
+    printf("arena_render resource=%s renders/s=%.0f allocs/render=%.1f\n", useArena ? "arena" : "heap",
+           renders / elapsed, (numAllocations - allocationsBefore) / (double)renders);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Tokenizes a source the way line wrapping does, returning the number of words.
+static long long tokenize(const Scanner& scanner, const char* s) {
+  long long numWords = 0;
+  while (true) {
+    s = scanner.skipSpacesExceptNewline(s);
+    if (*s == '\0') {
+      break;
+    } else if (*s == '\n') {
+      ++s;
+    } else {
+      s = scanner.skipWord(s);
+      ++numWords;
+    }
+  }
+  return numWords;
+}
+
+// Scans ordinary prose-like text and text made of long tokens (like URLs or base64) with each
+// scanner the CPU supports.
+static void benchWordScan() {
+  string prose = makeCorpus(16 << 20, 6);
+  string tokens = prose;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i] == ' ' && i % 97 != 0) {
+      tokens[i] = '_';
+    }
+  }
+  const double secondsPerRun = 0.5;
+
+  const char* corpusNames[] = { "prose", "long_tokens" };
+  const string* corpora[] = { &prose, &tokens };
+  for (int c = 0; c < 2; ++c) {
+    for (int impl = 0; impl < NUM_SCAN_IMPLS; ++impl) {
+      if (!isScanImplSupported((ScanImpl)impl)) {
+        continue;
+      }
+      const Scanner& scanner = getScanner((ScanImpl)impl);
+      long long numWords = 0;
+      int passes = 0;
+      Clock::time_point start = Clock::now();
+      while (secondsSince(start) < secondsPerRun) {
+        numWords = tokenize(scanner, corpora[c]->c_str());
+        ++passes;
+      }
+      double elapsed = secondsSince(start);
+      printf("word_scan corpus=%s scanner=%s MB/s=%.0f words=%lld\n", corpusNames[c], scanner.name,
+             (double)passes * corpora[c]->size() / elapsed / (1 << 20), numWords);
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Renders a layout that is mostly fill: a narrow text column between two wide columns of vertical
+// fillers, under a full-width border. Reports MB/s into a buffer and into a FILE*.
+static void benchBorders() {
+  string source = makeCorpus(64 << 10, 7);
+  const char* wordSources[1] = { source.c_str() };
+  TextTemplatePtr border = text_template_cache_get("*['+' 1s'-' '+']");
+  TextTemplatePtr body = text_template_cache_get(
+    "*['|' 1s[1s' ']^{1s'~'}v{1s'~'} '|' 20[{w' '} 1s' '] '|' 1s[1s' ']^{1s'~'}v{1s'~'} '|']");
+  const int width = 400;
+  const double secondsPerRun = 1.0;
+
+  RenderState state;
+  string out;
+  long long bytes = 0;
+  Clock::time_point start = Clock::now();
+  while (secondsSince(start) < secondsPerRun) {
+    renderToString(*border, width, NULL, &state, &out);
+    bytes += out.size();
+    renderToString(*body, width, wordSources, &state, &out);
+    bytes += out.size();
+  }
+  printf("borders output=buffer MB/s=%.0f\n", bytes / secondsSince(start) / (1 << 20));
+
+  FILE* file = tmpfile();
+  if (file == NULL) {
+    return;
+  }
+  bytes = 0;
+  start = Clock::now();
+  while (secondsSince(start) < secondsPerRun) {
+    rewind(file);
+    text_fprintf(file, *border, width);
+    text_fprintf(file, *body, width, wordSources);
+    bytes += ftell(file);
+  }
+  printf("borders output=FILE* MB/s=%.0f\n", bytes / secondsSince(start) / (1 << 20));
+  fclose(file);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Wraps a source into lines that each distribute their remaining length over several shares, both
+// between words and around them.
+static void benchShares() {
+  string source = makeCorpus(10 << 20, 11);
+  const char* wordSources[1] = { source.c_str() };
+  TextTemplatePtr tmpl = text_template_cache_get(
+    "*[' ' 1s[1s'<' 2s' ' {w 1s' ' 2s'-' 1s' '} 3s'.' 2s' ' 1s'>'] ' ']");
+  RenderState state;
+  string out;
+  long long allocationsBefore = numAllocations;
+  Clock::time_point start = Clock::now();
+  renderToString(*tmpl, 120, wordSources, &state, &out);
+  double seconds = secondsSince(start);
+  long long allocations = numAllocations - allocationsBefore;
+  printf("shares lines=%d ns/line=%.0f allocs/line=%.2f\n",
+         state.numTotalLines, seconds * 1e9 / state.numTotalLines, allocations / (double)state.numTotalLines);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// A dashboard of 8 columns, each wrapping its own large source, rendered with the columns wrapped
+// one after another and then on pools of increasing size. The output must not change.
+static void benchParallelColumns() {
+  const int numColumns = 8;
+  vector<string> sources;
+  vector<const char*> wordSources;
+  string format = "*[";
+  for (int i = 0; i < numColumns; ++i) {
+    sources.push_back(makeCorpus(2 << 20, 20 + i));
+    format += (i > 0) ? "'|'" : "";
+    format += "1s[{w' '}1s' ']v{1s' '}";
+  }
+  format += "]";
+  for (const string& source : sources) {
+    wordSources.push_back(source.c_str());
+  }
+  TextTemplatePtr tmpl = text_template_cache_get(format);
+  const int width = 400;
+
+  string expected;
+  Clock::time_point start = Clock::now();
+  text_sprintf(&expected, *tmpl, width, wordSources.data());
+  printf("parallel_columns threads=0 s=%.3f\n", secondsSince(start));
+  int threadCounts[] = { 1, 2, 4, 8 };
+  for (int numThreads : threadCounts) {
+    TextThreadPool pool(numThreads);
+    string out;
+    start = Clock::now();
+    text_sprintf(&out, *tmpl, width, wordSources.data(), NULL, NULL, &pool);
+    double seconds = secondsSince(start);
+    printf("parallel_columns threads=%d s=%.3f same=%d\n", numThreads, seconds, (int)(out == expected));
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// A tall document: one wide column over a large source, where writing the rows is most of the
+// work, rendered to a string and to lines on pools of increasing size.
+static void benchParallelRows() {
+  string source = makeCorpus(32 << 20, 31);
+  const char* wordSources[2] = { source.c_str(), source.c_str() };
+  TextTemplatePtr tmpl = text_template_cache_get("*['| ' 1s[{w' '}1s' ']v{1s' '} ' | ' 2s[{w 1s' '}1s' ']v{1s' '} ' |']");
+  const int width = 200;
+
+  string expected;
+  TextThreadPool sequential(1);
+  Clock::time_point start = Clock::now();
+  text_sprintf(&expected, *tmpl, width, wordSources, NULL, NULL, &sequential);
+  printf("parallel_rows output=string threads=1 s=%.3f\n", secondsSince(start));
+  int threadCounts[] = { 2, 4, 8 };
+  for (int numThreads : threadCounts) {
+    TextThreadPool pool(numThreads);
+    string out;
+    start = Clock::now();
+    text_sprintf(&out, *tmpl, width, wordSources, NULL, NULL, &pool);
+    double seconds = secondsSince(start);
+    printf("parallel_rows output=string threads=%d s=%.3f same=%d\n", numThreads, seconds, (int)(out == expected));
+  }
+
+  vector<string> expectedLines;
+  start = Clock::now();
+  text_sprintf_lines(&expectedLines, *tmpl, width, wordSources, NULL, NULL, &sequential);
+  printf("parallel_rows output=lines threads=1 s=%.3f\n", secondsSince(start));
+  for (int numThreads : threadCounts) {
+    TextThreadPool pool(numThreads);
+    vector<string> lines;
+    start = Clock::now();
+    text_sprintf_lines(&lines, *tmpl, width, wordSources, NULL, NULL, &pool);
+    double seconds = secondsSince(start);
+    printf("parallel_rows output=lines threads=%d s=%.3f same=%d\n", numThreads, seconds, (int)(lines == expectedLines));
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+static void countLine(const char*, int length, void* context) {
+  *static_cast<long long*>(context) += length + 1;
+}
+
+// Greedy and balanced ({w= ...}) line breaking of the same source at 1KB, 1MB and 100MB, streamed so
+// that the largest fits in memory. Balanced breaking is O(n log n) in the words of a paragraph.
+static void benchBalanced() {
+  TextTemplatePtr greedy = text_template_cache_get("*[' ' 1s[{w' '}1s' '] ' ']");
+  TextTemplatePtr balanced = text_template_cache_get("*[' ' 1s[{w=' '}1s' '] ' ']");
+  const int width = 80;
+  const int sizes[] = { 1 << 10, 1 << 20, 100 << 20 };
+  for (int size : sizes) {
+    string source = makeCorpus(size, 13);
+    const char* wordSources[1] = { source.c_str() };
+    for (int mode = 0; mode < 2; ++mode) {
+      const TextTemplate& tmpl = (mode == 0) ? *greedy : *balanced;
+      int numRuns = std::max(1, (1 << 20) / size);
+      long long bytes = 0;
+      Clock::time_point start = Clock::now();
+      for (int run = 0; run < numRuns; ++run) {
+        text_stream(tmpl, width, &countLine, &bytes, wordSources);
+      }
+      double seconds = secondsSince(start) / numRuns;
+      printf("balanced source=%dKB mode=%s ms=%.3f MB/s=%.0f\n", size >> 10, (mode == 0) ? "greedy" : "balanced",
+             seconds * 1e3, size / seconds / (1 << 20));
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Streams a 256MB file as a word source, read into a string first and then mapped in place.
+static void benchMappedSource() {
+  const char* path = "text_dsl_bench_source.txt";
+  {
+    string corpus = makeCorpus(256 << 20, 17);
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+      return;
+    }
+    fwrite(corpus.data(), 1, corpus.size(), file);
+    fclose(file);
+  }
+  TextTemplatePtr tmpl = text_template_cache_get("*[' ' 1s[{w' '}1s' '] ' ']");
+  const int width = 120;
+
+  long long bytes = 0;
+  long long allocationsBefore = numAllocations;
+  Clock::time_point start = Clock::now();
+  {
+    string source;
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    source.resize(ftell(file));
+    rewind(file);
+    fread(&source[0], 1, source.size(), file);
+    fclose(file);
+    const char* wordSources[1] = { source.c_str() };
+    text_stream(*tmpl, width, &countLine, &bytes, wordSources);
+  }
+  printf("mapped_source source=read s=%.3f allocs=%lld output=%lld\n", secondsSince(start),
+         numAllocations - allocationsBefore, bytes);
+
+  bytes = 0;
+  allocationsBefore = numAllocations;
+  start = Clock::now();
+  {
+    TextMappedFile file;
+    if (file.open(path)) {
+      const char* wordSources[1] = { file.data() };
+      text_stream(*tmpl, width, &countLine, &bytes, wordSources);
+    }
+  }
+  printf("mapped_source source=mapped s=%.3f allocs=%lld output=%lld\n", secondsSince(start),
+         numAllocations - allocationsBefore, bytes);
+  remove(path);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// A 50-row window deep into a 64MB two-column document: by streaming every line up to it, and from a
+// viewport's checkpoint index, which is built once.
+static void benchViewport() {
+  TextTemplatePtr tmpl = text_template_cache_get("*[' ' 2s[{w' '}1s' ']v{1s' '} ' | ' 1s[{w=' '}1s' ']v{1s' '} ' ']");
+  string left = makeCorpus(64 << 20, 19);
+  string right = makeCorpus(16 << 20, 23);
+  const char* wordSources[2] = { left.c_str(), right.c_str() };
+  const int width = 120;
+  const int numRows = 50;
+
+  Clock::time_point start = Clock::now();
+  TextViewport viewport(*tmpl, width, wordSources);
+  printf("viewport index s=%.3f lines=%d\n", secondsSince(start), viewport.numLines());
+
+  const int depths[] = { 0, 1000, 100000, viewport.numLines() - numRows };
+  for (int depth : depths) {
+    start = Clock::now();
+    vector<string> streamed;
+    TextLineStream stream(*tmpl, width, wordSources);
+    string line;
+    for (int lineNum = 0; lineNum < depth + numRows && stream.next(&line); ++lineNum) {
+      if (lineNum >= depth) {
+        streamed.push_back(line);
+      }
+    }
+    double streamSeconds = secondsSince(start);
+
+    start = Clock::now();
+    vector<string> window;
+    const int numRuns = 100;
+    for (int run = 0; run < numRuns; ++run) {
+      viewport.render(&window, depth, depth + numRows);
+    }
+    double viewportSeconds = secondsSince(start) / numRuns;
+    printf("viewport row=%d stream_ms=%.3f viewport_ms=%.3f same=%d\n", depth, streamSeconds * 1e3,
+           viewportSeconds * 1e3, (int)(window == streamed));
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// A small format with a few arguments, rendered at a high rate through the varargs and the typed
+// entry points. The output must not change.
+static void benchTypedFormat() {
+  const char* wordSources[1] = { "Short record text that wraps onto a few lines of its column." };
+  static const TextFormat typedFormat("%d[' ' 1s[{w' '}1s' ']v{1s' '} ' | ' %d['%s'1s' ']v{1s' '} ' ']");
+  const int numCalls = 200000;
+  string varargsOut, typedOut;
+  for (int mode = 0; mode < 2; ++mode) {
+    string* out = (mode == 0) ? &varargsOut : &typedOut;
+    Clock::time_point start = Clock::now();
+    for (int call = 0; call < numCalls; ++call) {
+      int width = 40 + call % 8;
+      if (mode == 0) {
+        text_sprintf(out, "%d[' ' 1s[{w' '}1s' ']v{1s' '} ' | ' %d['%s'1s' ']v{1s' '} ' ']", wordSources, NULL, width, 12, "id");
+      } else {
+        text_sprintf(out, typedFormat, wordSources, NULL, width, 12, "id");
+      }
+    }
+    double seconds = secondsSince(start);
+    printf("typed_format mode=%s calls/s=%.0f\n", (mode == 0) ? "varargs" : "typed", numCalls / seconds);
+  }
+  printf("typed_format same=%d\n", (int)(varargsOut == typedOut));
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// A small format whose lengths change from call to call, with the lengths expanded by printf (varargs
+// and typed) and taken as '$' length arguments, which skip the expansion and hit the template cache
+// with the format as written. With more distinct widths than the template cache holds, every printf
+// expansion is a new format to compile. The output must not change.
+static void benchLengthArgs() {
+  const char* wordSources[1] = { "Short record text that wraps onto a few lines of its column." };
+  static const TextFormat typedFormat("%d[' ' 1s[{w' '}1s' ']v{1s' '} ' | ' %d['id'1s' ']v{1s' '} ' ']");
+  const char* argsFormat = "$[' ' 1s[{w' '}1s' ']v{1s' '} ' | ' $['id'1s' ']v{1s' '} ' ']";
+  const char* modes[] = { "varargs", "typed", "length_args" };
+  const int numWidthsList[] = { 8, 2 * TEXT_TEMPLATE_CACHE_CAPACITY };
+  const int numCalls = 200000;
+  for (int numWidths : numWidthsList) {
+    string outs[3];
+    for (int mode = 0; mode < 3; ++mode) {
+      Clock::time_point start = Clock::now();
+      for (int call = 0; call < numCalls; ++call) {
+        int width = 40 + call % numWidths;
+        if (mode == 0) {
+          text_sprintf(&outs[mode], "%d[' ' 1s[{w' '}1s' ']v{1s' '} ' | ' %d['id'1s' ']v{1s' '} ' ']", wordSources, NULL, width, 12);
+        } else if (mode == 1) {
+          text_sprintf(&outs[mode], typedFormat, wordSources, NULL, width, 12);
+        } else {
+          const TextArg lengths[] = { width, 12 };
+          text_sprintf(&outs[mode], argsFormat, wordSources, NULL, TextArgs(lengths, 2));
+        }
+      }
+      printf("length_args widths=%d mode=%s calls/s=%.0f\n", numWidths, modes[mode], numCalls / secondsSince(start));
+    }
+    printf("length_args widths=%d same=%d\n", numWidths, (int)(outs[0] == outs[1] && outs[0] == outs[2]));
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// An indent that takes a costly lookup per line, as a LengthFunc, as a range with a context, and
+// precomputed; each lookup is counted.
+static atomic<long long> numIndentLookups(0);
+
+static int indentLookup(int line) {
+  ++numIndentLookups;
+  unsigned x = line;
+  for (int i = 0; i < 200; ++i) {
+    x = x * 1664525u + 1013904223u;
+  }
+  return x % 5;
+}
+
+static void indentRange(int lineBegin, int lineEnd, int* lengths, void* context) {
+  int base = *static_cast<const int*>(context);
+  for (int line = lineBegin; line < lineEnd; ++line) {
+    lengths[line - lineBegin] = base + indentLookup(line);
+  }
+}
+
+static void benchLengthSources() {
+  string corpus = makeCorpus(256 * 1024, 41);
+  const char* wordSources[2] = { corpus.c_str(), corpus.c_str() + corpus.size() / 2 };
+  TextTemplatePtr tmpl = text_template_cache_get("*['|' 1s[#' ' {w' '}1s' ']v{1s' '} ' | ' 1s[{w' '}1s' ' #'<']v{1s' '} '|']");
+  const int width = 100;
+  const int base = 0;
+  vector<int> precomputed(corpus.size());
+  for (int line = 0; line < (int)precomputed.size(); ++line) {
+    precomputed[line] = indentLookup(line);
+  }
+  const LengthFunc lengthFuncs[2] = { &indentLookup, &indentLookup };
+  const TextLengthSource rangeSources[2] = { TextLengthSource(&indentRange, (void*)&base), TextLengthSource(&indentRange, (void*)&base) };
+  const TextLengthSource arraySources[2] = { TextLengthSource(precomputed.data(), precomputed.size()),
+                                             TextLengthSource(precomputed.data(), precomputed.size()) };
+  const char* modes[] = { "length_funcs", "range", "precomputed" };
+  string outs[3];
+  for (int mode = 0; mode < 3; ++mode) {
+    numIndentLookups = 0;
+    const int numRenders = 5;
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < numRenders; ++i) {
+      if (mode == 0) {
+        text_sprintf(&outs[mode], *tmpl, width, wordSources, lengthFuncs);
+      } else {
+        TextLengthSources sources(mode == 1 ? rangeSources : arraySources, 2);
+        text_sprintf(&outs[mode], *tmpl, width, wordSources, sources);
+      }
+    }
+    double seconds = secondsSince(start) / numRenders;
+    long long numLines = count(outs[mode].begin(), outs[mode].end(), '\n') + 1;
+    printf("length_sources mode=%s lines=%lld lookups_per_line=%.2f ms=%.2f\n", modes[mode], numLines,
+           (double)numIndentLookups / numRenders / numLines, seconds * 1e3);
+  }
+  printf("length_sources same=%d\n", (int)(outs[0] == outs[1] && outs[0] == outs[2]));
+
+  // A '#' length in a block without Words has the length of line 0 on every line, from any source
+  TextTemplatePtr wordless = text_template_cache_get("*[1s[#'x' 1s'.']v{1s' '} ' ' 2s[{w' '}1s' ']v{1s' '}]");
+  string wordlessOuts[3];
+  bool rendered = text_try_sprintf(&wordlessOuts[0], *wordless, 40, NULL, wordSources, lengthFuncs);
+  text_sprintf(&wordlessOuts[1], *wordless, 40, wordSources, TextLengthSources(rangeSources, 1));
+  text_sprintf(&wordlessOuts[2], *wordless, 40, wordSources, TextLengthSources(arraySources, 1));
+  string expected = string(indentLookup(0), 'x') + '.';
+  bool ok = rendered && wordlessOuts[0].compare(0, expected.size(), expected) == 0 &&
+            wordlessOuts[0] == wordlessOuts[1] && wordlessOuts[0] == wordlessOuts[2];
+  printf("length_sources wordless_block ok=%d\n", (int)ok);
+  if (!ok) {
+    ++numFailures;
+  }
+}
+
+// Rejecting bad formats: the throwing compile() against text_validate, which neither throws nor
+// lays out CCs, over formats that fail to parse, fail to fit their lengths, and are valid.
+static void benchValidate() {
+  const char* formats[] = {
+    "25['|' 10[{w' '}1s' ']v{1s' '} '|' 12[{w=' '}1s' '] '|'",
+    "25['|' 10[{w' '}1s' ']v{1s' '} '|' 12[{w=' '}1s' '] '|' 5'x']",
+    "25['|' 10[{w' '}1s' ']v{1s' '} '|' 12[{w=' '}1s' '] '|']",
+  };
+  const char* kinds[] = { "syntax_error", "length_error", "valid" };
+  const int numCalls = 200000;
+  for (int i = 0; i < 3; ++i) {
+    int numCompiled = 0;
+    Clock::time_point start = Clock::now();
+    for (int call = 0; call < numCalls; ++call) {
+      TextTemplate tmpl(formats[i]);
+      try {
+        tmpl.compile();
+        ++numCompiled;
+      } catch (DSLException&) {
+      }
+    }
+    double compileSeconds = secondsSince(start);
+    int numValid = 0;
+    start = Clock::now();
+    for (int call = 0; call < numCalls; ++call) {
+      numValid += text_validate(formats[i], 0);
+    }
+    double validateSeconds = secondsSince(start);
+    printf("validate kind=%s compile_calls/s=%.0f validate_calls/s=%.0f agree=%d\n", kinds[i],
+           numCalls / compileSeconds, numCalls / validateSeconds, (int)(numCompiled == numValid));
+  }
+}
+
+// Layout negotiation: the row count of a three-column template at a range of widths, from a full
+// render against text_measure, which only counts the lines of each Words.
+static void benchMeasure() {
+  string corpus = makeCorpus(256 * 1024, 43);
+  const char* wordSources[3] = { corpus.c_str(), corpus.c_str() + corpus.size() / 3, corpus.c_str() + 2 * corpus.size() / 3 };
+  TextTemplatePtr tmpl = text_template_cache_get(
+    "*['|' 2s[{w' '}1s' ']^{1'-'}v{1s' '} '|' 1s[{w=' '}1s' ']v{1s' '} '|' 1s[{w' '}1s' ']v{1s' '} '|']");
+  const int numWidths = 8;
+  std::vector<std::string> lines;
+  long long numRenderedLines = 0;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < numWidths; ++i) {
+    text_sprintf_lines(&lines, *tmpl, 60 + 20 * i, wordSources);
+    numRenderedLines += lines.size();
+  }
+  double renderSeconds = secondsSince(start);
+  long long numMeasuredLines = 0;
+  long long allocationsBefore = numAllocations;
+  start = Clock::now();
+  for (int i = 0; i < numWidths; ++i) {
+    TextMeasure measure;
+    text_measure(&measure, *tmpl, 60 + 20 * i, NULL, wordSources);
+    numMeasuredLines += measure.numLines;
+  }
+  double measureSeconds = secondsSince(start);
+  printf("measure widths=%d lines=%lld render_ms=%.2f measure_ms=%.2f speedup=%.1f allocations/measure=%.1f same=%d\n",
+         numWidths, numRenderedLines, renderSeconds / numWidths * 1e3, measureSeconds / numWidths * 1e3,
+         renderSeconds / measureSeconds, (double)(numAllocations - allocationsBefore) / numWidths,
+         (int)(numRenderedLines == numMeasuredLines));
+
+  // Measuring must fail where rendering does, e.g. where no share takes the unused length of a line
+  const char* unsharedFormats[] = { "*[{w' '}]", "*[{w=' '} '|']", "*[1s[{w' '}]v{1s' '} 1s' ']" };
+  int numDisagreements = 0;
+  for (const char* format : unsharedFormats) {
+    TextTemplatePtr unshared = text_template_cache_get(format);
+    for (int width = 3; width < 120; ++width) {
+      TextMeasure measure;
+      TextError measureError, renderError;
+      bool measured = text_measure(&measure, *unshared, width, &measureError, wordSources);
+      bool rendered = text_try_sprintf_lines(&lines, *unshared, width, &renderError, wordSources);
+      if (measured != rendered || (rendered && measure.numLines != (int)lines.size()) ||
+          measureError.message != renderError.message) {
+        ++numDisagreements;
+      }
+    }
+  }
+  printf("measure unshared_lines disagreements=%d\n", numDisagreements);
+  if (numDisagreements > 0) {
+    ++numFailures;
+  }
+}
+
+// Sizing a pane: the narrowest width at which a template fits in a number of rows, by a binary search
+// of full renders against TextWidthSolver, which scans the word sources once and only measures.
+static void benchFitWidth() {
+  string corpus = makeCorpus(256 * 1024, 47);
+  const char* wordSources[2] = { corpus.c_str(), corpus.c_str() + corpus.size() / 2 };
+  TextTemplatePtr tmpl = text_template_cache_get("*['|' 2s[{w' '}1s' ']v{1s' '} '|' 1s[{w' '}1s' ']v{1s' '} '|']");
+  const int maxLines = 6000;
+  const int minWidth = 10;
+  const int maxWidth = 400;
+  Clock::time_point start = Clock::now();
+  int lo = minWidth - 1;
+  int hi = maxWidth;
+  int numRenders = 0;
+  std::vector<std::string> lines;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    text_sprintf_lines(&lines, *tmpl, mid, wordSources);
+    ++numRenders;
+    if ((int)lines.size() <= maxLines) {
+      hi = mid;
+    } else {
+      lo = mid;
+    }
+  }
+  double renderSeconds = secondsSince(start);
+  start = Clock::now();
+  TextWidthSolver solver(*tmpl, wordSources);
+  double scanSeconds = secondsSince(start);
+  TextFit fit;
+  solver.fitWidth(&fit, maxLines, minWidth, maxWidth);
+  double solveSeconds = secondsSince(start);
+  printf("fit_width width=%d lines=%d renders=%d render_ms=%.2f probes=%d scan_ms=%.2f solver_ms=%.2f speedup=%.1f same=%d\n",
+         fit.width, fit.numLines, numRenders, renderSeconds * 1e3, solver.numProbes, scanSeconds * 1e3,
+         solveSeconds * 1e3, renderSeconds / solveSeconds, (int)(fit.width == hi));
+
+  // Every width found must render, in the lines the solver found, also where most widths fail
+  string shortSource = corpus.substr(0, 400);
+  const char* shortSources[2] = { shortSource.c_str(), shortSource.c_str() + 200 };
+  const char* formats[] = { "*['|' 2s[{w' '}1s' ']v{1s' '} '|' 1s[{w' '}1s' ']v{1s' '} '|']", "*[{w' '}]", "*[{w=' '} '|']" };
+  int numChecked = 0, numBad = 0;
+  for (const char* format : formats) {
+    TextTemplatePtr fitTmpl = text_template_cache_get(format);
+    TextWidthSolver shortSolver(*fitTmpl, shortSources);
+    for (int numFitLines = 1; numFitLines <= 40; ++numFitLines) {
+      TextFit fits[2];
+      shortSolver.fitWidth(&fits[0], numFitLines, 3, 119);
+      shortSolver.fillWidth(&fits[1], numFitLines, 3, 119);
+      for (const TextFit& found : fits) {
+        if (found.width != UNKNOWN_COL) {
+          ++numChecked;
+          TextError error;
+          if (!text_try_sprintf_lines(&lines, *fitTmpl, found.width, &error, shortSources) ||
+              (int)lines.size() != found.numLines) {
+            ++numBad;
+          }
+        }
+      }
+    }
+  }
+  printf("fit_width rendered_widths checked=%d bad=%d\n", numChecked, numBad);
+  if (numBad > 0) {
+    ++numFailures;
+  }
+}
+
+// 100k table rows, each record with its own two cells of text, rendered by one call per record and
+// by text_sprintf_batch without and with a pool. The output must not change.
+static void benchBatch() {
+  const int numRecords = 100000;
+  string corpus = makeCorpus(4 << 20, 29);
+  vector<string> cells;
+  for (size_t at = 0; cells.size() < 2 * numRecords; ) {
+    size_t length = 20 + (cells.size() * 7919) % 140;
+    cells.push_back(corpus.substr(at, length));
+    at = (at + length) % (corpus.size() - 200);
+  }
+  vector<const char*> wordSources(2 * numRecords);
+  vector<TextRecord> records(numRecords);
+  for (int i = 0; i < numRecords; ++i) {
+    wordSources[2 * i] = cells[2 * i].c_str();
+    wordSources[2 * i + 1] = cells[2 * i + 1].c_str();
+    TextRecord record = { &wordSources[2 * i], NULL, (i % 16 == 0) ? 100 : 80, NULL };
+    records[i] = record;
+  }
+  TextTemplatePtr tmpl = text_template_cache_get(
+    "*['|' 2s[' '{w' '}1s' ']v{1s' '} '|' 1s[' '{w' '}1s' ']v{1s' '} '|']");
+
+  Clock::time_point start = Clock::now();
+  string perCall;
+  string out;
+  for (const TextRecord& record : records) {
+    text_sprintf(&out, *tmpl, record.width, record.wordSources, record.lengthFuncs);
+    perCall += out;
+    perCall += '\n';
+  }
+  printf("batch mode=per_call records/s=%.0f\n", numRecords / secondsSince(start));
+
+  const int poolSizes[] = { 0, 2, 4, 8 };
+  for (int numThreads : poolSizes) {
+    std::unique_ptr<TextThreadPool> pool(numThreads > 0 ? new TextThreadPool(numThreads) : NULL);
+    start = Clock::now();
+    string batch;
+    text_sprintf_batch(&batch, *tmpl, records.data(), numRecords, NULL, pool.get());
+    printf("batch mode=batch threads=%d records/s=%.0f same=%d\n", numThreads, numRecords / secondsSince(start),
+           (int)(batch == perCall));
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Allocations per wrapped line of large renders, counted both by a TextCountingResource under the
+// render state and by the global operator new, so that memory taken from outside the state's
+// resource shows up too. A wrapped line is one CCLine of a CC, which holds its own segments: one
+// allocation each, plus the amortized growth of the vectors of lines. Going over
+// ALLOCATIONS_PER_LINE_BUDGET is a regression: the case is reported with ok=0 and the process exits
+// with 1.
+static const double ALLOCATIONS_PER_LINE_BUDGET = 1.05;
+
+static void benchAllocationBudget() {
+  string source = makeCorpus(4 << 20, 37);
+  const char* wordSources[] = { source.c_str(), source.c_str() };
+  const char* formats[] = {
+    "*[' ' 1s[{w' '} 1s' '] ' ']",
+    "*[' ' 1s[{w 1s' '} 1s' '] ' ']",
+    "*[' ' 1s[1s'<' 2s' ' {w 1s' ' 2s'-' 1s' '} 3s'.' 2s' ' 1s'>'] ' ']",
+    "*['|' 2s[' '{w' '}1s' ']v{1s' '} '|' 1s[' '{w=' '}1s' ']v{1s' '} '|']",
+  };
+  for (const char* format : formats) {
+    TextTemplatePtr tmpl = text_template_cache_get(format);
+    TextCountingResource counter;
+    RenderState state(&counter);
+    string out;
+    out.reserve(64 << 20);
+    long long allocationsBefore = numAllocations;
+    renderToString(*tmpl, 100, wordSources, &state, &out);
+    long long allocations = numAllocations - allocationsBefore;
+    long long numLines = 0;
+    for (const CCState& ccState : state.ccs) {
+      numLines += ccState.lines.size();
+    }
+    double perLine = allocations / (double)numLines;
+    bool ok = (perLine <= ALLOCATIONS_PER_LINE_BUDGET);
+    printf("allocation_budget format=\"%s\" cc_lines=%lld allocs=%lld state_allocs=%lld state_bytes=%lld peak_bytes=%lld "
+           "allocs/line=%.4f budget=%.2f ok=%d\n",
+           format, numLines, allocations, counter.numAllocations, counter.bytesAllocated, counter.peakLiveBytes,
+           perLine, ALLOCATIONS_PER_LINE_BUDGET, (int)ok);
+    if (!ok) {
+      ++numFailures;
+    }
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Cost of collecting TextStats: the same small renders through a cached template without and with
+// a stats object, and what the stats collected.
+static void benchStats() {
+  const int numRenders = 200000;
+  string words = makeCorpus(200, 31);
+  const char* wordSources[] = { words.c_str(), words.c_str() };
+  const char* format = "*['|' 2s[' '{w' '}1s' ']v{1s' '} '|' 1s[' '{w' '}1s' ']v{1s' '} '|']";
+  TextTemplatePtr tmpl = text_template_cache_get(format);
+
+  string out;
+  TextStats stats;
+  for (int withStats = 0; withStats < 2; ++withStats) {
+    Clock::time_point start = Clock::now();
+    for (int i = 0; i < numRenders; ++i) {
+      text_sprintf(&out, *tmpl, 60, wordSources, NULL, NULL, NULL, withStats ? &stats : NULL);
+    }
+    printf("stats mode=%s renders/s=%.0f\n", withStats ? "stats" : "none", numRenders / secondsSince(start));
+  }
+  printf("stats layout_ns=%lld wrap_ns=%lld output_ns=%lld ccs=%lld lines=%lld words=%lld shares=%lld bytes=%lld\n",
+         stats.layoutNs / stats.numRenders, stats.wrapNs / stats.numRenders, stats.outputNs / stats.numRenders,
+         stats.numCCs / stats.numRenders, stats.numLinesWrapped / stats.numRenders, stats.numWordsPlaced / stats.numRenders,
+         stats.numShareDistributions / stats.numRenders, stats.numBytesEmitted / stats.numRenders);
+}
+
+// -------------------------------------------------------------------------------------------------
+
+// Phase by phase timings of the render pipeline over cases that stress each part of it. Every result
+// is one line
+//   phases case=<case> phase=<phase> runs=<n> s=<seconds per run> <unit>/s=<throughput> ...
+// with throughputs in bytes/s, lines/s or renders/s, so runs can be compared by a script. The
+// phases are parse (TextTemplate::compile), lengths (layoutLengths: '*' lengths, shares and
+// columns), flatten (layoutCCs), wrap (render with the layout already done), and printing every
+// line into a buffer and to a FILE*. Word sources too big to keep every line of are counted and
+// streamed instead of wrapped and printed.
+struct PhaseCase {
+  string name;
+  string format;
+  int width;
+  vector<string> sources;
+  bool streaming;
+};
+
+static const double PHASE_MIN_SECONDS = 0.2;
+
+// Calls run until PHASE_MIN_SECONDS have passed (at least once) and returns the seconds per call.
+template <typename Run>
+static double timePhase(Run run, int* numRuns) {
+  *numRuns = 0;
+  Clock::time_point start = Clock::now();
+  double seconds;
+  do {
+    run();
+    ++*numRuns;
+    seconds = secondsSince(start);
+  } while (seconds < PHASE_MIN_SECONDS);
+  return seconds / *numRuns;
+}
+
+static void reportPhase(const PhaseCase& phaseCase, const char* phase, int numRuns, double seconds,
+                        long long bytes, long long lines) {
+  printf("phases case=%s phase=%s runs=%d s=%.9f", phaseCase.name.c_str(), phase, numRuns, seconds);
+  if (bytes > 0) {
+    printf(" bytes/s=%.0f", bytes / seconds);
+  }
+  if (lines > 0) {
+    printf(" lines/s=%.0f", lines / seconds);
+  }
+  printf(" renders/s=%.1f\n", 1 / seconds);
+  fflush(stdout);
+}
+
+static FILE* openNullFile() {
+#ifdef _WIN32
+  return fopen("NUL", "wb");
+#else
+  return fopen("/dev/null", "wb");
+#endif
+}
+
+static void runPhaseCase(const PhaseCase& phaseCase) {
+  int numRuns;
+  double seconds;
+  long long sourceBytes = 0;
+  vector<const char*> wordSources;
+  for (const string& source : phaseCase.sources) {
+    wordSources.push_back(source.c_str());
+    sourceBytes += source.size();
+  }
+
+  seconds = timePhase([&]() {
+    TextTemplate tmpl(phaseCase.format);
+    tmpl.compile();
+  }, &numRuns);
+  reportPhase(phaseCase, "parse", numRuns, seconds, phaseCase.format.size(), 0);
+
+  TextTemplate tmpl(phaseCase.format);
+  tmpl.compile();
+  Layout layout;
+  seconds = timePhase([&]() { tmpl.layoutLengths(&layout, phaseCase.width); }, &numRuns);
+  reportPhase(phaseCase, "lengths", numRuns, seconds, 0, 0);
+  seconds = timePhase([&]() { tmpl.layoutCCs(&layout); }, &numRuns);
+  reportPhase(phaseCase, "flatten", numRuns, seconds, 0, 0);
+
+  RenderState state;
+  if (phaseCase.streaming) {
+    seconds = timePhase([&]() { tmpl.renderStreaming(&state, phaseCase.width, wordSources.data(), NULL); }, &numRuns);
+    reportPhase(phaseCase, "count", numRuns, seconds, sourceBytes, state.numTotalLines);
+    string line(state.numCols, ' ');
+    seconds = timePhase([&]() {
+      tmpl.renderStreaming(&state, phaseCase.width, wordSources.data(), NULL);
+      for (int lineNum = 0; lineNum < state.numTotalLines; ++lineNum) {
+        char* bufAt = &line[0];
+        tmpl.streamContentLine(&bufAt, &state, lineNum);
+      }
+    }, &numRuns);
+    reportPhase(phaseCase, "count_and_stream", numRuns, seconds, sourceBytes, state.numTotalLines);
+    return;
+  }
+
+  tmpl.render(&state, phaseCase.width, wordSources.data(), NULL);   // lays out, so wrap times only wrapping
+  seconds = timePhase([&]() { tmpl.render(&state, phaseCase.width, wordSources.data(), NULL); }, &numRuns);
+  reportPhase(phaseCase, "wrap", numRuns, seconds, sourceBytes, state.numTotalLines);
+
+  long long outputBytes = (long long)(state.numCols + 1) * state.numTotalLines;
+  string buffer(outputBytes, ' ');
+  seconds = timePhase([&]() {
+    char* bufAt = &buffer[0];
+    for (int lineNum = 0; lineNum < state.numTotalLines; ++lineNum) {
+      tmpl.printContentLine(&bufAt, state, lineNum);
+      *bufAt = '\n';
+      ++bufAt;
+    }
+  }, &numRuns);
+  reportPhase(phaseCase, "print_buffer", numRuns, seconds, outputBytes, state.numTotalLines);
+
+  FILE* file = openNullFile();
+  if (file != NULL) {
+    seconds = timePhase([&]() {
+      for (int lineNum = 0; lineNum < state.numTotalLines; ++lineNum) {
+        tmpl.printContentLine(file, state, lineNum);
+        fputc('\n', file);
+      }
+    }, &numRuns);
+    reportPhase(phaseCase, "print_file", numRuns, seconds, outputBytes, state.numTotalLines);
+    fclose(file);
+  }
+}
+
+static void benchPhases() {
+  // Each case runs as soon as it is built, so only one case's sources are in memory at a time
+  {
+    // 200 nested blocks around one column of words
+    PhaseCase phaseCase = { "deep_nesting", "", 1000, vector<string>(1, makeCorpus(1 << 20, 31)), false };
+    const int depth = 200;
+    for (int i = 0; i < depth; ++i) {
+      phaseCase.format += "1s['<' ";
+    }
+    phaseCase.format += "1s[{w' '}1s' ']";
+    for (int i = 0; i < depth; ++i) {
+      phaseCase.format += " '>']";
+    }
+    phaseCase.format = "*[" + phaseCase.format + "]";
+    runPhaseCase(phaseCase);
+  }
+  {
+    // 2000 columns side by side, each with its own words
+    PhaseCase phaseCase = { "sibling_columns", "*[", 2000 * 16, vector<string>(), false };
+    const int numColumns = 2000;
+    string corpus = makeCorpus(numColumns * 2048, 37);
+    for (int i = 0; i < numColumns; ++i) {
+      phaseCase.format += "1s[{w' '}1s' ']v{1s' '} '|'";
+      phaseCase.sources.push_back(corpus.substr(i * 2048, 2048));
+    }
+    phaseCase.format += "]";
+    runPhaseCase(phaseCase);
+  }
+  {
+    // One column of words over sources from 1MB to 1GB; from 256MB on, streamed
+    const int sizesMB[] = { 1, 16, 64, 256, 1024 };
+    for (int sizeMB : sizesMB) {
+      PhaseCase phaseCase = { "source_" + to_string(sizeMB) + "MB", "*[' ' 1s[{w' '}1s' '] ' ']", 120,
+                              vector<string>(1, makeCorpus(sizeMB << 20, 41)), sizeMB >= 256 };
+      runPhaseCase(phaseCase);
+    }
+  }
+  {
+    // 8 columns whose words, margins and gaps are all shares, distributed anew on every line
+    PhaseCase phaseCase = { "heavy_shares", "*[", 8 * 60, vector<string>(), false };
+    for (int i = 0; i < 8; ++i) {
+      phaseCase.format += "1s'.' 3s[1s'<' 2s' ' {w 1s' ' 2s'-' 1s' '} 3s'.' 2s' ' 1s'>']v{1s' '} 2s'~' ";
+      phaseCase.sources.push_back(makeCorpus(2 << 20, 43 + i));
+    }
+    phaseCase.format += "]";
+    runPhaseCase(phaseCase);
+  }
+  {
+    // 20 one-line blocks whose vertical fillers stretch them to the height of a long column
+    PhaseCase phaseCase = { "tall_vertical_fillers", "*[", 20 * 12 + 100, vector<string>(1, makeCorpus(16 << 20, 53)), false };
+    for (int i = 0; i < 20; ++i) {
+      phaseCase.format += "10['cell'1s' ']^{1s'^' 2s'=' 1s'^'}v{1s'v' 3s'.' 1s'v'} '|' ";
+    }
+    phaseCase.format += "1s[{w' '}1s' ']]";
+    runPhaseCase(phaseCase);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+struct Benchmark {
+  const char* name;
+  void(*run)();
+};
+
+static const Benchmark benchmarks[] = {
+  { "concurrent_render", &benchConcurrentRender },
+  { "streaming", &benchStreaming },
+  { "line_allocations", &benchLineAllocations },
+  { "arena_render", &benchArenaRender },
+  { "word_scan", &benchWordScan },
+  { "borders", &benchBorders },
+  { "shares", &benchShares },
+  { "parallel_columns", &benchParallelColumns },
+  { "parallel_rows", &benchParallelRows },
+  { "balanced", &benchBalanced },
+  { "mapped_source", &benchMappedSource },
+  { "viewport", &benchViewport },
+  { "typed_format", &benchTypedFormat },
+  { "length_args", &benchLengthArgs },
+  { "length_sources", &benchLengthSources },
+  { "validate", &benchValidate },
+  { "measure", &benchMeasure },
+  { "fit_width", &benchFitWidth },
+  { "batch", &benchBatch },
+  { "stats", &benchStats },
+  { "allocation_budget", &benchAllocationBudget },
+  { "phases", &benchPhases },
+};
+
+// Runs every benchmark, or only those named on the command line.
+int main(int argc, char** argv) {
+  for (const Benchmark& benchmark : benchmarks) {
+    bool selected = (argc <= 1);
+    for (int i = 1; i < argc; ++i) {
+      if (strcmp(argv[i], benchmark.name) == 0) {
+        selected = true;
+      }
+    }
+    if (selected) {
+      benchmark.run();
+    }
+  }
+  return (numFailures > 0) ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+#include "format.h"
+#include "ast.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <cctype>
+#include <cstdarg>
+
+TextFormat::TextFormat(const char* format)
+  : format(format), errorAt(-1), error(NULL) {
+  const char* f_begin = this->format.c_str();
+  const char* f_at = f_begin;
+  while ((f_at = strchr(f_at, '%')) != NULL) {
+    Conversion c;
+    c.begin = f_at - f_begin;
+    ++f_at;
+    if (*f_at == '%') {
+      ++f_at;
+      continue;
+    }
+    while (*f_at != '\0' && strchr("-+ #0", *f_at) != NULL) {
+      ++f_at;
+    }
+    c.widthArg = (*f_at == '*');
+    if (c.widthArg) {
+      ++f_at;
+    } else {
+      while (isdigit((unsigned char)*f_at)) {
+        ++f_at;
+      }
+    }
+    c.precisionArg = false;
+    if (*f_at == '.') {
+      ++f_at;
+      c.precisionArg = (*f_at == '*');
+      if (c.precisionArg) {
+        ++f_at;
+      } else {
+        while (isdigit((unsigned char)*f_at)) {
+          ++f_at;
+        }
+      }
+    }
+    c.specEnd = f_at - f_begin;
+    while (*f_at != '\0' && strchr("hljztL", *f_at) != NULL) {
+      ++f_at;
+    }
+    c.conversion = *f_at;
+    switch (c.conversion) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+      c.type = TextArg::INTEGER;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      c.type = TextArg::FLOATING;
+      break;
+    case 's':
+      c.type = TextArg::STRING;
+      break;
+    case 'p':
+      c.type = TextArg::POINTER;
+      break;
+    default:
+      errorAt = f_at - f_begin;
+      error = (c.conversion == '\0') ? "Expected a conversion character after '%'." : "Unknown conversion.";
+      conversions.clear();
+      return;
+    }
+    ++f_at;
+    c.end = f_at - f_begin;
+    conversions.push_back(c);
+  }
+}
+
+int TextFormat::numArgs() const {
+  int n = 0;
+  for (const Conversion& c : conversions) {
+    n += 1 + c.widthArg + c.precisionArg;
+  }
+  return n;
+}
+
+// ---
+
+// Appends one conversion formatted by vsnprintf, which only ever sees a single argument of the type
+// the spec asks for.
+static void appendFormatted(std::string* str, const char* spec, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, spec);
+  int n = vsnprintf(buf, sizeof(buf), spec, args);
+  va_end(args);
+  if (n >= 0 && n < (int)sizeof(buf)) {
+    str->append(buf, n);
+    return;
+  }
+  // On Windows, vsnprintf returns -1 if the buffer is too small; elsewhere, the size needed
+  std::string big;
+  int size = (n >= 0) ? n + 1 : 2 * (int)sizeof(buf);
+  for (;;) {
+    big.resize(size);
+    va_start(args, spec);
+    n = vsnprintf(&big[0], size, spec, args);
+    va_end(args);
+    if (n >= 0 && n < size) {
+      break;
+    }
+    size = (n >= 0) ? n + 1 : 2 * size;
+  }
+  str->append(big.data(), n);
+}
+
+static const TextArg& nextArg(const char* f_at, const TextArgs& args, int* argIndex, TextArg::Type type) {
+  if (*argIndex >= args.numArgs) {
+    throw DSLException(f_at, "Missing argument for this conversion.");
+  }
+  const TextArg& arg = args.args[(*argIndex)++];
+  if (arg.type != type && !(type == TextArg::POINTER && arg.type == TextArg::STRING)) {
+    switch (type) {
+    case TextArg::INTEGER:
+      throw DSLException(f_at, "Argument for this conversion is not an integer.");
+    case TextArg::FLOATING:
+      throw DSLException(f_at, "Argument for this conversion is not a floating-point number.");
+    case TextArg::STRING:
+      throw DSLException(f_at, "Argument for this conversion is not a string.");
+    default:
+      throw DSLException(f_at, "Argument for this conversion is not a pointer.");
+    }
+  }
+  return arg;
+}
+
+// Plain "%d" and "%u", the common case for lengths, without going through vsnprintf
+static void appendInteger(std::string* str, unsigned long long magnitude, bool negative) {
+  char digits[24];
+  char* at = digits + sizeof(digits);
+  do {
+    *--at = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (negative) {
+    *--at = '-';
+  }
+  str->append(at, digits + sizeof(digits) - at);
+}
+
+// The literal text between conversions, with each "%%" in it as '%'
+static void appendLiteral(std::string* str, const char* f_at, const char* f_end) {
+  for (;;) {
+    const char* percent = (const char*)memchr(f_at, '%', f_end - f_at);
+    if (percent == NULL) {
+      str->append(f_at, f_end - f_at);
+      return;
+    }
+    str->append(f_at, percent + 1 - f_at);
+    f_at = percent + 2;
+  }
+}
+
+static int starArg(const char* f_at, const TextArgs& args, int* argIndex) {
+  const TextArg& arg = nextArg(f_at, args, argIndex, TextArg::INTEGER);
+  return (int)arg.i;
+}
+
+void TextFormat::expand(std::string* str, const TextArgs& args) const {
+  const char* f_begin = format.c_str();
+  if (errorAt >= 0) {
+    throw DSLException(f_begin + errorAt, error);
+  }
+  str->clear();
+  str->reserve(format.length() + 16 * conversions.size());
+  int literalBegin = 0;
+  int argIndex = 0;
+  std::string spec;
+  for (const Conversion& c : conversions) {
+    const char* f_at = f_begin + c.begin;
+    appendLiteral(str, f_begin + literalBegin, f_at);
+    literalBegin = c.end;
+
+    // '*' arguments are written into the spec as numbers, so vsnprintf only gets the value
+    spec.assign(f_at, f_begin + c.specEnd);
+    if (c.widthArg) {
+      spec.replace(spec.find('*'), 1, std::to_string(starArg(f_at, args, &argIndex)));
+    }
+    if (c.precisionArg) {
+      size_t dot = spec.rfind('.');
+      int precision = starArg(f_at, args, &argIndex);
+      if (precision < 0) {
+        spec.erase(dot);    // as if there were no precision
+      } else {
+        spec.replace(dot + 1, 1, std::to_string(precision));
+      }
+    }
+
+    const TextArg& arg = nextArg(f_at, args, &argIndex, c.type);
+    bool plain = (c.specEnd - c.begin == 1);
+    switch (c.type) {
+    case TextArg::INTEGER:
+      if (plain && (c.conversion == 'd' || c.conversion == 'i')) {
+        appendInteger(str, arg.i < 0 ? 0ull - (unsigned long long)arg.i : (unsigned long long)arg.i, arg.i < 0);
+      } else if (plain && c.conversion == 'u') {
+        appendInteger(str, arg.wide ? (unsigned long long)arg.i : (unsigned int)arg.i, false);
+      } else if (c.conversion == 'c') {
+        spec += 'c';
+        appendFormatted(str, spec.c_str(), (int)arg.i);
+      } else if (c.conversion == 'd' || c.conversion == 'i') {
+        spec += "lld";
+        appendFormatted(str, spec.c_str(), arg.i);
+      } else {
+        unsigned long long u = arg.wide ? (unsigned long long)arg.i : (unsigned int)arg.i;
+        spec += "ll";
+        spec += c.conversion;
+        appendFormatted(str, spec.c_str(), u);
+      }
+      break;
+    case TextArg::FLOATING:
+      spec += c.conversion;
+      appendFormatted(str, spec.c_str(), arg.d);
+      break;
+    case TextArg::STRING:
+      if (plain && arg.s != NULL) {
+        str->append(arg.s);   // plain "%s": no need to go through vsnprintf
+      } else {
+        spec += 's';
+        appendFormatted(str, spec.c_str(), arg.s != NULL ? arg.s : "(null)");
+      }
+      break;
+    default:
+      spec += 'p';
+      appendFormatted(str, spec.c_str(), arg.type == TextArg::STRING ? (const void*)arg.s : arg.p);
+      break;
+    }
+  }
+  appendLiteral(str, f_begin + literalBegin, f_begin + format.length());
+  if (argIndex < args.numArgs) {
+    throw DSLException(f_begin + format.length(), "More arguments than conversions.");
+  }
+}
@@ -0,0 +1,78 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <string>
+#include <vector>
+
+// One argument of a typed text_*printf call. Only the types below convert to a TextArg, so passing
+// anything else (a std::vector, a struct, nullptr, ...) is a compile error rather than undefined
+// behavior in vsnprintf, and the type each argument had is known when the format is expanded.
+struct TextArg {
+  enum Type { NONE, INTEGER, FLOATING, STRING, POINTER };
+
+  TextArg() : type(NONE), wide(false) { i = 0; }
+  TextArg(char v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(signed char v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(unsigned char v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(short v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(unsigned short v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(int v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(unsigned int v) : type(INTEGER), wide(false) { i = v; }
+  TextArg(long v) : type(INTEGER), wide(sizeof(long) > sizeof(int)) { i = v; }
+  TextArg(unsigned long v) : type(INTEGER), wide(sizeof(long) > sizeof(int)) { i = (long long)v; }
+  TextArg(long long v) : type(INTEGER), wide(true) { i = v; }
+  TextArg(unsigned long long v) : type(INTEGER), wide(true) { i = (long long)v; }
+  TextArg(float v) : type(FLOATING), wide(false) { d = v; }
+  TextArg(double v) : type(FLOATING), wide(false) { d = v; }
+  TextArg(long double v) : type(FLOATING), wide(false) { d = (double)v; }
+  TextArg(const char* v) : type(STRING), wide(false) { s = v; }
+  TextArg(const std::string& v) : type(STRING), wide(false) { s = v.c_str(); }
+  TextArg(const void* v) : type(POINTER), wide(false) { p = v; }
+
+  Type type;
+  bool wide;    // an integer wider than int; narrower ones print as unsigned int under %u, %x and %o
+  union {
+    long long i;
+    double d;
+    const char* s;
+    const void* p;
+  };
+};
+
+struct TextArgs {
+  TextArgs(const TextArg* args, int numArgs) : args(args), numArgs(numArgs) {}
+
+  const TextArg* args;
+  int numArgs;
+};
+
+// A printf-style format string whose conversions are parsed once, when it is constructed, so it is
+// typically a static next to the call. Expanding it checks the number and the types of the arguments
+// against the conversions and formats each argument on its own: there is no va_list, a mismatch is
+// reported as a DSLException pointing at the conversion, and an argument of the wrong kind is never
+// read as another. Supports the flags, widths and precisions of printf ('*' included), the
+// conversions d i u o x X c e E f F g G a A s p and %%; length modifiers are accepted and ignored,
+// as the argument types are known.
+struct TextFormat {
+  explicit TextFormat(const char* format);
+
+  void expand(std::string* str, const TextArgs& args) const;   // throws DSLException
+  int numArgs() const;   // arguments expected, '*' widths and precisions included
+
+  struct Conversion {
+    int begin;            // the '%'
+    int specEnd;          // end of the flags, width and precision
+    int end;              // past the conversion character
+    bool widthArg;        // '*' width
+    bool precisionArg;    // '*' precision
+    char conversion;
+    TextArg::Type type;
+  };
+
+  std::string format;     // errors point into this string
+  std::vector<Conversion> conversions;
+  int errorAt;            // -1 if the conversions parsed
+  const char* error;
+};
+
+#endif
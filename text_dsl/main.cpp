@@ -51,7 +51,8 @@ int main() {
     getline(cin, format);
 
     cout << endl;
-    text_printf(format.c_str(), wordSources, lengthFuncs, 80, "hello world");
+    // Typed, so a format typed in with the wrong conversions is reported instead of read past the arguments
+    text_printf(TextFormat(format.c_str()), wordSources, lengthFuncs, 80, "hello world");
     cout << endl << endl;
   }
 
@@ -66,18 +67,24 @@ const int fontPointSize = 10;
 int widthPixels, heightPixels;
 
 //string formatNoLength = "[ 1s[1s'_']^{1s'@'}v{1s'@'}  ' [''?''] '   5s[ 1s[#' '{w' '1s' '}1s' ']^{1s'^'}v{1s'v'} ' | ' 1s[1s' '{w' '}1s' ' ]^{'='1s'^'}v{2s'v''-'} ' | ' 40[1s' '{w' '}]^{'WEW'1s'^'}v{1s'v''LAD'} ]^{1s'<'}v{1s'>'}     ]";
-string textFormat = "%d[' ' 1s[{w' '}1s' ']^{}v{1s'.'} ' | ' 1s[1s' '{w' '1s' '}]^{1s' ''='}v{'='1s' '} ' @ ' 1s[1s' '{w'::'}]^{1s' '}v{1s' '} ' ']";
-string borderFormat = "%d[' ' 1s'-' ' + ' 1s'-' ' @ ' 1s'-' ' ']";
+string textFormat = "*[' ' 1s[{w' '}1s' ']^{}v{1s'.'} ' | ' 1s[1s' '{w' '1s' '}]^{1s' ''='}v{'='1s' '} ' @ ' 1s[1s' '{w'::'}]^{1s' '}v{1s' '} ' ']";
+string borderFormat = "*[' ' 1s'-' ' + ' 1s'-' ' @ ' 1s'-' ' ']";
 vector<string> lines;
 
 void updateLines(int numCols) {
+  // Compiled once; each resize only lays the templates out again at the new width.
+  static TextTemplatePtr textTemplate = text_template(textFormat.c_str());
+  static TextTemplatePtr borderTemplate = text_template(borderFormat.c_str());
   lines.clear();
+  if (!textTemplate || !borderTemplate) {
+    return;
+  }
   //dsl_sprintf(&lines, format.c_str(), &linefunc, s1, s2, s1);
   const char* wordSources[3] = { s1, s2, s3 };
   const char* wordSources2[3] = { s2, s3, s1 };
-  text_sprintf_lines_append(&lines, textFormat.c_str(), wordSources, NULL, numCols);
-  text_sprintf_lines_append(&lines, borderFormat.c_str(), NULL, NULL, numCols);
-  text_sprintf_lines_append(&lines, textFormat.c_str(), wordSources2, NULL, numCols);
+  text_sprintf_lines_append(&lines, *textTemplate, numCols, wordSources);
+  text_sprintf_lines_append(&lines, *borderTemplate, numCols);
+  text_sprintf_lines_append(&lines, *textTemplate, numCols, wordSources2);
 }
 
 
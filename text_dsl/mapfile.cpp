@@ -0,0 +1,138 @@
+#include "mapfile.h"
+
+#include <stdlib.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+TextMappedFile::TextMappedFile()
+  : chars(""), numChars(0), mapping(NULL), mappingSize(0), copied(false) {}
+
+TextMappedFile::~TextMappedFile() {
+  close();
+}
+
+void TextMappedFile::close() {
+  if (mapping != NULL) {
+    if (copied) {
+      free(mapping);
+    } else {
+#ifdef _WIN32
+      UnmapViewOfFile(mapping);
+#else
+      munmap(mapping, mappingSize);
+#endif
+    }
+  }
+  chars = "";
+  numChars = 0;
+  mapping = NULL;
+  mappingSize = 0;
+  copied = false;
+}
+
+#ifdef _WIN32
+
+bool TextMappedFile::open(const char* path) {
+  close();
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || (unsigned long long)fileSize.QuadPart >= (size_t)-1) {
+    CloseHandle(file);
+    return false;
+  }
+  size_t size = (size_t)fileSize.QuadPart;
+  SYSTEM_INFO systemInfo;
+  GetSystemInfo(&systemInfo);
+  bool ok = true;
+  if (size == 0) {
+    // Nothing to map; data() stays ""
+  } else if (size % systemInfo.dwPageSize != 0) {
+    // The rest of the last page reads as zeros
+    HANDLE fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (fileMapping != NULL) {
+      mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(fileMapping);
+    }
+    ok = (mapping != NULL);
+    mappingSize = size;
+  } else {
+    // No zero byte after the contents within the view
+    mapping = malloc(size + 1);
+    copied = true;
+    DWORD numRead = 0;
+    for (size_t at = 0; ok && at < size; at += numRead) {
+      DWORD toRead = (DWORD)std::min<size_t>(size - at, 1u << 30);
+      ok = mapping != NULL && ReadFile(file, (char*)mapping + at, toRead, &numRead, NULL) && numRead > 0;
+    }
+    if (ok) {
+      ((char*)mapping)[size] = '\0';
+    }
+  }
+  CloseHandle(file);
+  if (!ok) {
+    close();
+    return false;
+  }
+  if (mapping != NULL) {
+    chars = (const char*)mapping;
+    numChars = size;
+  }
+  return true;
+}
+
+#else
+
+bool TextMappedFile::open(const char* path) {
+  close();
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size >= (size_t)-1) {
+    ::close(fd);
+    return false;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    ::close(fd);
+    return true;
+  }
+  // Reserve zeroed pages for the file and at least one byte past it, then map the file over their
+  // start: the bytes after the end of the file in its last page read as zeros, too.
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t length = (size / pageSize + 1) * pageSize;
+  void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+  void* fileBase = mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+  ::close(fd);
+  if (fileBase == MAP_FAILED) {
+    munmap(base, length);
+    return false;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);   // wrapping reads front to back
+  mapping = base;
+  mappingSize = length;
+  chars = (const char*)base;
+  numChars = size;
+  return true;
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+
+// A whole file mapped read-only into memory, to pass as a word source without reading or copying
+// it: wrapping runs straight over the mapped pages. Word sources are '\0'-terminated and the word
+// scanners read whole aligned blocks, so the mapping is followed by at least one zero byte and is
+// readable to the end of its last page. On Windows, a file whose size is an exact multiple of the
+// page size has no room for that, and is read into memory instead. A '\0' inside the file ends the
+// source there.
+struct TextMappedFile {
+  TextMappedFile();
+  ~TextMappedFile();
+
+  bool open(const char* path);   // closes any file already open; false if it cannot be mapped
+  void close();
+
+  const char* data() const { return chars; }   // "" if no file is open
+  size_t size() const { return numChars; }
+
+private:
+  const char* chars;
+  size_t numChars;
+  void* mapping;        // base of the mapping, or of the copy, to unmap or free; NULL if none
+  size_t mappingSize;
+  bool copied;
+
+  TextMappedFile(const TextMappedFile&);
+  TextMappedFile& operator=(const TextMappedFile&);
+};
+
+#endif
@@ -0,0 +1,358 @@
+#include "parser.h"
+#include "ast.h"
+
+#include <stdio.h>
+#include <cctype>
+#include <assert.h>
+
+// Every parse function stops at the first error: it sets *error and returns, and its caller returns
+// as soon as error->message is set, so nothing is thrown and the rest of the format is not looked at.
+
+static bool isSpace(char c) {
+  return (c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v');
+}
+
+// Should be called after any token is parsed so that fptr is moved to the start of the next token
+static void parseWhitespaces(const char** fptr) {
+  while (isSpace(**fptr)) {
+    ++*fptr;
+  }
+}
+
+static int parseUint(const char** fptr) {
+  assert(std::isdigit(**fptr));
+  int value = 0;
+  do {
+    int digit = **fptr - '0';
+    value = value * 10 + digit;
+    ++*fptr;
+  } while (std::isdigit(**fptr));
+  return value;
+}
+
+// Used for parsing the next char within a quote, surrounded by the specified quote character.
+// Any character can be escaped by a preceding backslash; only the escaped character is returned.
+static char parseCharInsideQuotes(const char** fptr, char quote, DSLError* error) {
+  assert(**fptr != quote);
+  char c = **fptr;
+  if (c == '\0') {
+    error->set(*fptr, "Reached end of string; expected char.");
+    return '\0';
+  }
+  ++*fptr;
+  if (c == '\\') {
+    // parse and return the character directly after the backslash.
+    c = **fptr;
+    ++*fptr;
+  }
+  return c;
+}
+
+static char parseCharLiteral(const char** fptr, DSLError* error) {  // TOKEN
+  assert(**fptr == '\'');
+  ++*fptr;
+  if (**fptr == '\'') {
+    error->set(*fptr, "Exected char literial; found '' instead.");
+    return '\0';
+  }
+  char c = parseCharInsideQuotes(&*fptr, '\'', error);
+  if (error->message != NULL) {
+    return '\0';
+  }
+  if (**fptr != '\'') {
+    error->set(*fptr, "Expected closing ' for char literal.");
+    return '\0';
+  }
+  ++*fptr;
+  parseWhitespaces(fptr);
+  return c;
+}
+
+static FillerPtr parseStringLiteral(const char** fptr, DSLError* error) { // TOKEN
+  assert(**fptr == '\'');
+  const char* f_at = *fptr;
+  ++*fptr;
+  std::string str;
+  while (**fptr != '\'') {
+    str += parseCharInsideQuotes(&*fptr, '\'', error);
+    if (error->message != NULL) {
+      return FillerPtr();
+    }
+  }
+  ++*fptr;
+  parseWhitespaces(fptr);
+  return FillerPtr(new StringLiteral(f_at, str));
+}
+
+static bool isLiteralLengthStart(char c) {
+  return std::isdigit(c) || c == '$';
+}
+
+// numArgs is NULL where '$' is not allowed: the lengths of interword and vertical fillers are part of
+// the template rather than of a Layout.
+static LiteralLength parseLiteralLength(const char** fptr, int* numArgs, DSLError* error) {
+  assert(isLiteralLengthStart(**fptr) || **fptr == '*');
+  if (**fptr == '*') {
+    // '*' takes the width passed to render; it cannot be a share count.
+    ++*fptr;
+    parseWhitespaces(fptr);
+    return LiteralLength(RENDER_WIDTH, false);
+  }
+  LiteralLength ll(0, false);
+  if (**fptr == '$') {
+    if (numArgs == NULL) {
+      error->set(*fptr, "Interword and vertical fillers cannot have '$' lengths.");
+      return ll;
+    }
+    // '$' takes the next length argument of the render; arguments are bound in order of appearance
+    ll = LiteralLength(ARG_LENGTH, false, *numArgs);
+    ++*numArgs;
+    ++*fptr;
+  } else {
+    ll.value = parseUint(fptr);
+  }
+  if (**fptr == 's') {
+    ll.shares = true;
+    ++*fptr;
+  }
+  parseWhitespaces(fptr);
+  return ll;
+}
+
+static FunctionLength parseFunctionLength(const char** fptr, int* numLengthFuncs) {
+  assert(**fptr == '#');
+  FunctionLength fl(*numLengthFuncs, false);   // length funcs are bound in order of appearance
+  ++*numLengthFuncs;
+  ++*fptr;
+  if (**fptr == 's') {
+    fl.shares = true;
+    ++*fptr;
+  }
+  parseWhitespaces(fptr);
+  return fl;
+}
+
+// Parses 0 or more fillers
+static void parseFillers(const char** fptr, std::vector<FillerPtr>* fillers, DSLError* error) {
+  while (**fptr == '\'' || isLiteralLengthStart(**fptr)) {
+    FillerPtr filler;
+    if (**fptr == '\'') {
+      filler = parseStringLiteral(fptr, error);
+    } else {
+      const char* f_at = *fptr;
+      LiteralLength length = parseLiteralLength(fptr, NULL, error);
+      if (error->message != NULL) {
+        return;
+      }
+      if (**fptr == '\'') {
+        char c = parseCharLiteral(fptr, error);
+        filler.reset(new RepeatedCharLL(f_at, length, c));
+      } else {
+        error->set(*fptr, "Expected char literal after literal length.");
+      }
+    }
+    if (error->message != NULL) {
+      return;
+    }
+    fillers->push_back(std::move(filler));
+  }
+}
+
+static ASTPtr parseRepeatedCharFL(const char** fptr, int* numLengthFuncs, DSLError* error) {
+  assert(**fptr == '#');
+  const char* f_at = *fptr;
+  FunctionLength length = parseFunctionLength(fptr, numLengthFuncs);
+  if (**fptr != '\'') {
+    error->set(*fptr, "Expected char literal after function length.");
+    return ASTPtr();
+  }
+  char c = parseCharLiteral(fptr, error);
+  if (error->message != NULL) {
+    return ASTPtr();
+  }
+  return ASTPtr(new RepeatedCharFL(f_at, length, c));
+}
+
+static char parseSilhouetteCharLiteral(const char** fptr, DSLError* error) {
+  assert(**fptr == '-');
+  ++*fptr;
+  if (**fptr != '>') {
+    error->set(*fptr, "Expected > immediately after -.");
+    return '\0';
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // -> is a token
+  if (**fptr != '\'') {
+    error->set(*fptr, "Expected char literal after ->.");
+    return '\0';
+  }
+  return parseCharLiteral(fptr, error);
+}
+
+static ASTPtr parseWords(const char** fptr, int* numWordSources, DSLError* error) {
+  assert(**fptr == '{');
+  Words* words = new Words(*fptr, *numWordSources); // word sources are bound in order of appearance
+  ++*numWordSources;
+  ASTPtr ast(words);
+  ++*fptr;
+  parseWhitespaces(fptr); // { is a token
+  if (**fptr != 'w') {
+    error->set(*fptr, "Expected w after {.");
+    return ASTPtr();
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // w is a token
+  if (**fptr == '=') {
+    words->balanced = true;
+    ++*fptr;
+    parseWhitespaces(fptr); // = is a token
+  }
+  if (**fptr == '-') {
+    words->wordSilhouette = parseSilhouetteCharLiteral(fptr, error);
+    if (error->message != NULL) {
+      return ASTPtr();
+    }
+  }
+  parseFillers(fptr, &words->interwordFillers, error);
+  if (error->message != NULL) {
+    return ASTPtr();
+  }
+  if (**fptr != '}') {
+    error->set(*fptr, "Expected }, ->, or interword fillers.");
+    return ASTPtr();
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // } is a token
+  return ast;
+}
+
+static void parseTopOrBottomFiller(const char** fptr, std::vector<FillerPtr>* fillers, bool top,
+                                   DSLError* error) {
+  char firstChar = top ? '^' : 'v';
+  assert(**fptr == firstChar);
+  ++*fptr;
+  parseWhitespaces(fptr); // ^, v are tokens
+  if (**fptr != '{') {
+    error->set(*fptr, "Expected {.");
+    return;
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // { is a token
+  parseFillers(fptr, fillers, error);
+  if (error->message != NULL) {
+    return;
+  }
+  if (**fptr != '}') {
+    error->set(*fptr, "Expected }.");
+    return;
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // } is a token
+}
+
+// ^{...} and v{...} after a block's ], in either order
+static void parseVerticalFillers(const char** fptr, Block* block, DSLError* error) {
+  if (**fptr == '^') {
+    parseTopOrBottomFiller(fptr, &block->topFillers, true, error);
+    if (error->message == NULL && **fptr == 'v') {
+      parseTopOrBottomFiller(fptr, &block->bottomFillers, false, error);
+    }
+  } else if (**fptr == 'v') {
+    parseTopOrBottomFiller(fptr, &block->bottomFillers, false, error);
+    if (error->message == NULL && **fptr == '^') {
+      parseTopOrBottomFiller(fptr, &block->topFillers, true, error);
+    }
+  }
+}
+
+static ASTPtr parseSpecifiedLengthContent(const char** fptr, int* numWordSources, int* numLengthFuncs,
+                                          int* numArgs, DSLError* error) {
+  assert(**fptr == '\'' || isLiteralLengthStart(**fptr) || **fptr == '#' || **fptr == '*');
+  if (**fptr == '\'') {
+    return parseStringLiteral(fptr, error);
+  } else if (**fptr == '#') {
+    return parseRepeatedCharFL(fptr, numLengthFuncs, error);
+  }
+  const char* f_at = *fptr;
+  LiteralLength length = parseLiteralLength(fptr, numArgs, error);
+  if (error->message != NULL) {
+    return ASTPtr();
+  }
+  if (**fptr == '\'') {
+    char c = parseCharLiteral(fptr, error);
+    if (error->message != NULL) {
+      return ASTPtr();
+    }
+    return ASTPtr(new RepeatedCharLL(f_at, length, c));
+  } else if (**fptr != '[') {
+    error->set(*fptr, "Expected ' or [ after length specifier.");
+    return ASTPtr();
+  }
+  Block* block = new Block(f_at, length);
+  ASTPtr slc(block);
+  ++*fptr;
+  parseWhitespaces(fptr); // [ is a token
+  while (**fptr != ']') {
+    if (**fptr == '\'' || isLiteralLengthStart(**fptr) || **fptr == '#') {
+      ASTPtr child = parseSpecifiedLengthContent(fptr, numWordSources, numLengthFuncs, numArgs, error);
+      if (error->message == NULL) {
+        block->addChild(std::move(child), error);
+      }
+    } else if (**fptr == '{') {
+      ASTPtr words = parseWords(fptr, numWordSources, error);
+      if (error->message == NULL) {
+        block->addWords(std::move(words), error);
+      }
+    } else {
+      error->set(*fptr, "Expected ', digit, $, or # to begin specified-length content, "
+        "or { to begin greedy-length content.");
+    }
+    if (error->message != NULL) {
+      return ASTPtr();
+    }
+  }
+  ++*fptr;
+  parseWhitespaces(fptr); // ] is a token
+  parseVerticalFillers(fptr, block, error);
+  if (error->message != NULL) {
+    return ASTPtr();
+  }
+  return slc;
+}
+
+ASTPtr parseFormat(const char** fptr, int* numWordSources, int* numLengthFuncs, int* numArgs,
+                   DSLError* error) {
+  parseWhitespaces(fptr);
+  // Will insert all root content as children into a super-root Block. Its length is the total
+  // length of the root content, which is only known once '*' lengths take the render width, so
+  // it's summed up when the template is laid out.
+  Block* rootsParentBlock = new Block(*fptr, LiteralLength(0, false));
+  ASTPtr rootsParent(rootsParentBlock);
+  while (**fptr != '\0') {
+    if (**fptr == '\'' || isLiteralLengthStart(**fptr) || **fptr == '*') {
+      ASTPtr root = parseSpecifiedLengthContent(fptr, numWordSources, numLengthFuncs, numArgs, error);
+      if (error->message != NULL) {
+        return ASTPtr();
+      }
+      const LiteralLength* rootLength = root->getLiteralLength();
+      if (rootLength == NULL || rootLength->shares) {
+        error->set(root->f_at, "Root content must be fixed-length.");
+        return ASTPtr();
+      }
+      rootsParentBlock->addChild(std::move(root), error);
+    } else {
+      error->set(*fptr, "Expected ', digit, $, or *.");
+      return ASTPtr();
+    }
+  }
+  return rootsParent;
+}
+
+ASTPtr parseFormat(const char** fptr, int* numWordSources, int* numLengthFuncs, int* numArgs) {
+  DSLError error;
+  ASTPtr rootsParent = parseFormat(fptr, numWordSources, numLengthFuncs, numArgs, &error);
+  if (error.message != NULL) {
+    throw DSLException(error.f_at, error.message);
+  }
+  return rootsParent;
+}
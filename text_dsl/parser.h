@@ -0,0 +1,15 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include "ast.h"
+
+// Parses a fully-evaluated format string into a super-root Block containing all root content.
+// Words, function lengths and '$' lengths are numbered in order of appearance; numWordSources,
+// numLengthFuncs and numArgs are incremented for each one encountered. Throws DSLException on syntax
+// errors.
+ASTPtr parseFormat(const char** fptr, int* numWordSources, int* numLengthFuncs, int* numArgs);
+// The same without throwing: on a syntax error, sets *error and returns NULL.
+ASTPtr parseFormat(const char** fptr, int* numWordSources, int* numLengthFuncs, int* numArgs,
+                   DSLError* error);
+
+#endif
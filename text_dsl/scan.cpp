@@ -0,0 +1,236 @@
+#include "scan.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// The vector scanners read whole aligned blocks, which can extend past the end of the source
+// allocation; tell the sanitizers that this is intended. AVX2 code needs a target attribute outside
+// of MSVC, which allows the intrinsics anywhere.
+#if defined(__GNUC__) || defined(__clang__)
+#define SCAN_NO_SANITIZE __attribute__((no_sanitize_address, no_sanitize("thread")))
+#define SCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define SCAN_NO_SANITIZE
+#define SCAN_TARGET_AVX2
+#endif
+
+static bool isSpace(char c) {
+  return (c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v');
+}
+
+static const char* skipWordScalar(const char* s) {
+  while (*s != '\0' && !isSpace(*s)) {
+    ++s;
+  }
+  return s;
+}
+
+static const char* skipSpacesExceptNewlineScalar(const char* s) {
+  while (isSpace(*s) && *s != '\n') {
+    ++s;
+  }
+  return s;
+}
+
+// -------------------------------------------------------------------------------------------------
+#ifdef SCAN_X86
+
+static int countTrailingZeros(unsigned mask) {
+  assert(mask != 0);
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+// Whitespace is ' ' or '\t' (9) through '\r' (13): c - 9 <= 4 unsigned.
+static __m128i isSpace16(__m128i v) {
+  __m128i fromTab = _mm_sub_epi8(v, _mm_set1_epi8(9));
+  __m128i tabToCR = _mm_cmpeq_epi8(_mm_min_epu8(fromTab, _mm_set1_epi8(4)), fromTab);
+  return _mm_or_si128(tabToCR, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+SCAN_NO_SANITIZE static unsigned wordStopMask16(const char* p) {
+  __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(p));
+  __m128i stop = _mm_or_si128(isSpace16(v), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  return (unsigned)_mm_movemask_epi8(stop);
+}
+SCAN_NO_SANITIZE static unsigned spacesStopMask16(const char* p) {
+  __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(p));
+  __m128i skip = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), isSpace16(v));
+  return ~(unsigned)_mm_movemask_epi8(skip) & 0xFFFFu;
+}
+
+// Scans the aligned block containing s first, ignoring the bytes before s, then whole blocks.
+SCAN_NO_SANITIZE static const char* skipWordSSE2(const char* s) {
+  uintptr_t offset = reinterpret_cast<uintptr_t>(s) & 15;
+  const char* p = s - offset;
+  unsigned mask = wordStopMask16(p) & (0xFFFFu << offset);
+  while (mask == 0) {
+    p += 16;
+    mask = wordStopMask16(p);
+  }
+  return p + countTrailingZeros(mask);
+}
+SCAN_NO_SANITIZE static const char* skipSpacesExceptNewlineSSE2(const char* s) {
+  uintptr_t offset = reinterpret_cast<uintptr_t>(s) & 15;
+  const char* p = s - offset;
+  unsigned mask = spacesStopMask16(p) & (0xFFFFu << offset);
+  while (mask == 0) {
+    p += 16;
+    mask = spacesStopMask16(p);
+  }
+  return p + countTrailingZeros(mask);
+}
+
+SCAN_TARGET_AVX2 static __m256i isSpace32(__m256i v) {
+  __m256i fromTab = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+  __m256i tabToCR = _mm256_cmpeq_epi8(_mm256_min_epu8(fromTab, _mm256_set1_epi8(4)), fromTab);
+  return _mm256_or_si256(tabToCR, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static unsigned wordStopMask32(const char* p) {
+  __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(p));
+  __m256i stop = _mm256_or_si256(isSpace32(v), _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+  return (unsigned)_mm256_movemask_epi8(stop);
+}
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static unsigned spacesStopMask32(const char* p) {
+  __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(p));
+  __m256i skip = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), isSpace32(v));
+  return ~(unsigned)_mm256_movemask_epi8(skip);
+}
+
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static const char* skipWordAVX2(const char* s) {
+  uintptr_t offset = reinterpret_cast<uintptr_t>(s) & 31;
+  const char* p = s - offset;
+  unsigned mask = wordStopMask32(p) & (0xFFFFFFFFu << offset);
+  while (mask == 0) {
+    p += 32;
+    mask = wordStopMask32(p);
+  }
+  return p + countTrailingZeros(mask);
+}
+SCAN_NO_SANITIZE SCAN_TARGET_AVX2 static const char* skipSpacesExceptNewlineAVX2(const char* s) {
+  uintptr_t offset = reinterpret_cast<uintptr_t>(s) & 31;
+  const char* p = s - offset;
+  unsigned mask = spacesStopMask32(p) & (0xFFFFFFFFu << offset);
+  while (mask == 0) {
+    p += 32;
+    mask = spacesStopMask32(p);
+  }
+  return p + countTrailingZeros(mask);
+}
+
+static void cpuid(int leaf, int subleaf, unsigned regs[4]) {
+#ifdef _MSC_VER
+  int r[4];
+  __cpuidex(r, leaf, subleaf);
+  for (int i = 0; i < 4; ++i) {
+    regs[i] = (unsigned)r[i];
+  }
+#else
+  __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static unsigned long long xgetbv0() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+static bool cpuHasSSE2() {
+  unsigned regs[4];
+  cpuid(1, 0, regs);
+  return (regs[3] & (1u << 26)) != 0;
+}
+
+// AVX2 also needs the OS to save the YMM registers (OSXSAVE, and XCR0 bits 1 and 2).
+static bool cpuHasAVX2() {
+  unsigned regs[4];
+  cpuid(0, 0, regs);
+  if (regs[0] < 7) {
+    return false;
+  }
+  cpuid(1, 0, regs);
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  if (!osxsave || !avx || (xgetbv0() & 6) != 6) {
+    return false;
+  }
+  cpuid(7, 0, regs);
+  return (regs[1] & (1u << 5)) != 0;
+}
+
+#endif
+// -------------------------------------------------------------------------------------------------
+
+static const Scanner scanners[NUM_SCAN_IMPLS] = {
+  { "scalar", &skipWordScalar, &skipSpacesExceptNewlineScalar },
+#ifdef SCAN_X86
+  { "sse2", &skipWordSSE2, &skipSpacesExceptNewlineSSE2 },
+  { "avx2", &skipWordAVX2, &skipSpacesExceptNewlineAVX2 },
+#else
+  { "sse2", NULL, NULL },
+  { "avx2", NULL, NULL },
+#endif
+};
+
+static bool detectScanImpl(ScanImpl impl) {
+  switch (impl) {
+  case SCAN_SCALAR:
+    return true;
+#ifdef SCAN_X86
+  case SCAN_SSE2:
+    return cpuHasSSE2();
+  case SCAN_AVX2:
+    return cpuHasAVX2();
+#endif
+  default:
+    return false;
+  }
+}
+
+// Detected during static initialization, before any thread can render.
+static const bool scanImplSupported[NUM_SCAN_IMPLS] = {
+  detectScanImpl(SCAN_SCALAR), detectScanImpl(SCAN_SSE2), detectScanImpl(SCAN_AVX2)
+};
+
+static const Scanner* selectBestScanner() {
+  for (int impl = NUM_SCAN_IMPLS - 1; impl > SCAN_SCALAR; --impl) {
+    if (scanImplSupported[impl]) {
+      return &scanners[impl];
+    }
+  }
+  return &scanners[SCAN_SCALAR];
+}
+static const Scanner* const best = selectBestScanner();
+
+bool isScanImplSupported(ScanImpl impl) {
+  return impl >= 0 && impl < NUM_SCAN_IMPLS && scanImplSupported[impl];
+}
+
+const Scanner& getScanner(ScanImpl impl) {
+  assert(isScanImplSupported(impl));
+  return scanners[impl];
+}
+
+const Scanner& bestScanner() {
+  return *best;
+}
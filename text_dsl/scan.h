@@ -0,0 +1,24 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Word-boundary scanning of word sources, the innermost loop of line wrapping. Whitespace is
+// ' ', '\f', '\n', '\r', '\t' and '\v'. Besides the scalar scanner there are SSE2 and AVX2 ones that
+// classify 16 or 32 bytes at a time; the best one the CPU supports is chosen once at startup.
+// Sources are '\0'-terminated with no known length, so the vector scanners only use aligned loads,
+// which may read past the '\0' but never into the next page.
+
+enum ScanImpl { SCAN_SCALAR, SCAN_SSE2, SCAN_AVX2, NUM_SCAN_IMPLS };
+
+typedef const char* (*ScanFunc)(const char* s);
+
+struct Scanner {
+  const char* name;
+  ScanFunc skipWord;                  // returns the first whitespace or '\0' at or after s
+  ScanFunc skipSpacesExceptNewline;   // returns the first non-whitespace or '\n' at or after s
+};
+
+bool isScanImplSupported(ScanImpl impl);
+const Scanner& getScanner(ScanImpl impl);   // impl must be supported
+const Scanner& bestScanner();
+
+#endif
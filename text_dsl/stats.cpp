@@ -0,0 +1,58 @@
+#include "stats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <chrono>
+#endif
+
+void TextStats::reset() {
+  numRenders = 0;
+  formatNs = parseNs = layoutNs = wrapNs = outputNs = 0;
+  numNodesParsed = numCCs = numLinesWrapped = numWordsPlaced = numShareDistributions = numBytesEmitted = 0;
+  numAllocations = bytesAllocated = peakLiveBytes = 0;
+}
+
+void TextStats::add(const TextStats& other) {
+  numRenders += other.numRenders;
+  formatNs += other.formatNs;
+  parseNs += other.parseNs;
+  layoutNs += other.layoutNs;
+  wrapNs += other.wrapNs;
+  outputNs += other.outputNs;
+  numNodesParsed += other.numNodesParsed;
+  numCCs += other.numCCs;
+  numLinesWrapped += other.numLinesWrapped;
+  numWordsPlaced += other.numWordsPlaced;
+  numShareDistributions += other.numShareDistributions;
+  numBytesEmitted += other.numBytesEmitted;
+  numAllocations += other.numAllocations;
+  bytesAllocated += other.bytesAllocated;
+  if (other.peakLiveBytes > peakLiveBytes) {
+    peakLiveBytes = other.peakLiveBytes;
+  }
+}
+
+#ifdef _WIN32
+
+// The steady_clock of the older toolsets this builds with only ticks every few milliseconds
+long long textNowNs() {
+  static LARGE_INTEGER frequency;
+  if (frequency.QuadPart == 0) {
+    QueryPerformanceFrequency(&frequency);
+  }
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return (long long)((double)counter.QuadPart * 1e9 / frequency.QuadPart);
+}
+
+#else
+
+long long textNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
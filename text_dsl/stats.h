@@ -0,0 +1,37 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Where the time of text_* calls went and how much work they did, for finding out why a render is
+// slow. Pass one to a call to have its counts and phase times added in, so one TextStats can sum a
+// sample of calls; reset() starts over. Without one, a call only checks for NULL once per phase.
+struct TextStats {
+  TextStats() { reset(); }
+  void reset();
+  void add(const TextStats& other);
+
+  long long numRenders;     // each record of a batch counts as one
+
+  // Nanoseconds per phase
+  long long formatNs;   // expanding the printf conversions of a format
+  long long parseNs;    // finding the template in the cache, and compiling it on a miss
+  long long layoutNs;   // binding the render, and laying the template out when the width needs it
+  long long wrapNs;     // wrapping the words into lines, and the vertical layout
+  long long outputNs;   // printing the lines
+
+  long long numNodesParsed;         // nodes of the templates compiled; 0 for cache hits
+  long long numCCs;                 // ConsistentContents rendered
+  long long numLinesWrapped;        // lines of Words
+  long long numWordsPlaced;
+  long long numShareDistributions;  // llSharesToLength calls and their compiled equivalents
+  long long numBytesEmitted;
+
+  // Memory of the render state, counted by a TextCountingResource in front of the arena or the
+  // caller's resource
+  long long numAllocations;
+  long long bytesAllocated;
+  long long peakLiveBytes;          // the largest of the calls, not their sum
+};
+
+long long textNowNs();   // a monotonic clock for the phase times
+
+#endif
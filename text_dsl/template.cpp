@@ -0,0 +1,510 @@
+#include "template.h"
+#include "parser.h"
+#include "visitor.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "format.h"
+
+#include <list>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+
+static std::atomic<unsigned long long> nextTemplateId(1);
+
+TextTemplate::TextTemplate(const std::string& format)
+  : id(nextTemplateId++), format(format), renderWidthNode(NULL),
+  numWordSources(0), numLengthFuncs(0), numArgs(0), numBlocks(0) {}
+
+void TextTemplate::compile() {
+  DSLError error;
+  if (!compile(&error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::compile(DSLError* error) {
+  if (!parse(error)) {
+    return false;
+  }
+  if (renderWidthNode == NULL && numArgs == 0) {
+    return layout(&fixedLayout, UNKNOWN_COL, NULL, error);
+  }
+  return true;
+}
+
+bool TextTemplate::parse(DSLError* error) {
+  const char* f_at = format.c_str();
+  root = parseFormat(&f_at, &numWordSources, &numLengthFuncs, &numArgs, error);
+  if (error->message != NULL) {
+    return false;
+  }
+  NodeIndexVisitor nodeIndexer;
+  root->accept(&nodeIndexer);
+  nodes = nodeIndexer.nodes;
+  numBlocks = nodeIndexer.numBlocks;
+  for (const AST* node : nodes) {
+    const LiteralLength* ll = node->getLiteralLength();
+    if (ll != NULL && ll->value == RENDER_WIDTH) {
+      renderWidthNode = node;
+      break;
+    }
+  }
+  return true;
+}
+
+void TextTemplate::layout(Layout* layout, int width, const TextArgs* args) const {
+  DSLError error;
+  if (!this->layout(layout, width, args, &error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::layout(Layout* layout, int width, const TextArgs* args, DSLError* error) const {
+  if (!layoutLengths(layout, width, args, error)) {
+    return false;
+  }
+  layoutCCs(layout);
+  layout->width = width;
+  layout->templateId = id;
+  return true;
+}
+
+void TextTemplate::layoutLengths(Layout* layout, int width, const TextArgs* args) const {
+  DSLError error;
+  if (!layoutLengths(layout, width, args, &error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::layoutLengths(Layout* layout, int width, const TextArgs* args, DSLError* error) const {
+  layout->templateId = 0;   // invalid until the layout passes succeed
+  layout->numShareDistributions = 0;
+  if (renderWidthNode != NULL && width < 0) {
+    error->set(renderWidthNode->f_at, "Expected a non-negative render width for '*' length.");
+    return false;
+  }
+  int numArgsGiven = (args != NULL) ? args->numArgs : 0;
+  if (numArgsGiven > numArgs) {
+    error->set(format.c_str() + format.length(), "More length arguments than '$' lengths.");
+    return false;
+  }
+  layout->args.assign(numArgs, UNKNOWN_COL);
+  for (int i = 0; i < numArgsGiven; ++i) {
+    const TextArg& arg = args->args[i];
+    if (arg.type == TextArg::INTEGER && arg.i >= 0 && arg.i <= INT_MAX) {
+      layout->args[i] = (int)arg.i;
+    }
+  }
+  layout->nodes.assign(nodes.size(), NodeLayout());
+  for (int i = 0; i < nodes.size(); ++i) {
+    const LiteralLength* ll = nodes[i]->getLiteralLength();
+    if (ll != NULL) {
+      layout->nodes[i].length = *ll;
+      if (ll->value == RENDER_WIDTH) {
+        layout->nodes[i].length.value = width;
+      } else if (ll->value == ARG_LENGTH) {
+        if (ll->argIndex >= numArgsGiven) {
+          error->set(nodes[i]->f_at, "Missing length argument for '$' length.");
+          return false;
+        }
+        if (layout->args[ll->argIndex] == UNKNOWN_COL) {
+          error->set(nodes[i]->f_at, "Expected a non-negative integer argument for '$' length.");
+          return false;
+        }
+        layout->nodes[i].length.value = layout->args[ll->argIndex];
+      }
+    }
+  }
+  const Block* rootsParent = static_cast<const Block*>(root.get());
+  LiteralLength& rootLength = layout->nodes[rootsParent->nodeIndex].length;
+  rootLength.value = 0;
+  for (const ASTPtr& child : rootsParent->children) {
+    rootLength.value += child->getFixedLength(*layout);
+  }
+
+  root->convertLLSharesToLength(layout, error);
+  if (error->message != NULL) {
+    return false;
+  }
+  root->computeStartEndCols(layout, 0, rootLength.value, error);
+  if (error->message != NULL) {
+    return false;
+  }
+  layout->numCols = rootLength.value;
+  return true;
+}
+
+void TextTemplate::layoutCCs(Layout* layout) const {
+  layout->ccs.clear();
+  TextVector<const Block*> blocksStack(layout->ccs.get_allocator());
+  root->flatten(static_cast<const Block*>(root.get()), layout, true, &blocksStack);
+  for (ConsistentContent& cc : layout->ccs) {
+    cc.compileLinePlan(*layout);
+  }
+}
+
+// Whether a layout's '$' lengths were resolved from these arguments
+static bool sameArgs(const Layout& layout, const TextArgs* args) {
+  int numArgsGiven = (args != NULL) ? args->numArgs : 0;
+  if (numArgsGiven != (int)layout.args.size()) {
+    return false;
+  }
+  for (int i = 0; i < numArgsGiven; ++i) {
+    if (args->args[i].type != TextArg::INTEGER || args->args[i].i != layout.args[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TextTemplate::bindRender(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                              DSLError* error) const {
+  TextStats* stats = state->stats;
+  long long startNs = (stats != NULL) ? textNowNs() : 0;
+  if (renderWidthNode == NULL && numArgs == 0) {
+    state->layout = &fixedLayout;
+  } else {
+    if (renderWidthNode == NULL) {
+      width = UNKNOWN_COL;  // only the arguments matter
+    }
+    const Layout* last = state->sharedLayout.get();
+    if (last == NULL || last->templateId != id || last->width != width || !sameArgs(*last, state->args)) {
+      bool laidOut;
+      std::shared_ptr<const Layout> found = findLayout(width, state->args, &laidOut, error);
+      if (!found) {
+        return false;
+      }
+      state->sharedLayout = found;
+      if (stats != NULL && laidOut) {
+        stats->numShareDistributions += state->sharedLayout->numShareDistributions;
+      }
+    }
+    state->layout = state->sharedLayout.get();
+  }
+
+  state->wordSources = wordSources;
+  state->lengthFuncs = lengthFuncs;
+  // A state rendered again with the same number of CCs, like each record of a batch, keeps the
+  // memory of its CC and block states
+  TextMemoryResource* ccResource = (state->pool != NULL) ? &state->lockedResource : state->resource;
+  int numCCs = state->layout->ccs.size();
+  if (numCCs > 0 && (int)state->ccs.size() == numCCs && state->ccs[0].lines.get_allocator().resource == ccResource) {
+    for (CCState& ccState : state->ccs) {
+      ccState.reset();
+    }
+  } else {
+    state->ccs.clear();
+    state->ccs.resize(numCCs, CCState(ccResource));
+  }
+  if ((int)state->blocks.size() == numBlocks) {
+    for (BlockState& blockState : state->blocks) {
+      blockState.reset();
+    }
+  } else {
+    state->blocks.clear();
+    state->blocks.resize(numBlocks, BlockState(state->resource));
+  }
+  if (stats != NULL) {
+    stats->layoutNs += textNowNs() - startNs;
+  }
+  return true;
+}
+
+std::shared_ptr<const Layout> TextTemplate::findLayout(int width, const TextArgs* args, bool* laidOut,
+                                                       DSLError* error) const {
+  *laidOut = false;
+  {
+    std::lock_guard<std::mutex> lock(layoutsMutex);
+    for (auto it = layouts.begin(); it != layouts.end(); ++it) {
+      if ((*it)->width == width && sameArgs(**it, args)) {
+        layouts.splice(layouts.begin(), layouts, it);
+        return layouts.front();
+      }
+    }
+  }
+
+  // Lay out outside of the lock; a layout made by two threads at once is just cached twice
+  std::shared_ptr<Layout> laid(new Layout());
+  if (!layout(laid.get(), width, args, error)) {
+    return std::shared_ptr<const Layout>();
+  }
+  *laidOut = true;
+  std::lock_guard<std::mutex> lock(layoutsMutex);
+  layouts.push_front(laid);
+  if (layouts.size() > TEXT_LAYOUT_CACHE_CAPACITY) {
+    layouts.pop_back();
+  }
+  return laid;
+}
+
+void TextTemplate::computeLines(RenderState* state) const {
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+
+  root->computeNumContentLines(state);
+  root->computeNumTotalLines(state, root->getNumFixedLines(*state));
+  root->computeBlockVerticalFillersShares(state);
+
+  state->numCols = state->layout->numCols;
+  state->numTotalLines = state->blocks[0].numTotalLines;  // the root is visited first
+  for (int i = 0; i < ccs.size(); ++i) {
+    ccs[i].generateLinesChars(*state, &state->ccs[i]);
+  }
+}
+
+void TextTemplate::render(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs) const {
+  DSLError error;
+  if (!render(state, width, wordSources, lengthFuncs, &error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::render(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                          DSLError* error) const {
+  if (!bindRender(state, width, wordSources, lengthFuncs, error)) {
+    return false;
+  }
+  long long startNs = (state->stats != NULL) ? textNowNs() : 0;
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  if (state->pool != NULL) {
+    // CCs only write their own CCState, and the BlockState of their own block if they have Words
+    state->pool->parallelFor(ccs.size(), [&](int i) {
+      ccs[i].generateCCLines(state, &state->ccs[i]);
+    });
+  } else {
+    for (int i = 0; i < ccs.size(); ++i) {
+      ccs[i].generateCCLines(state, &state->ccs[i]);
+    }
+  }
+  computeLines(state);
+  if (state->stats != NULL) {
+    addRenderStats(state, startNs);
+  }
+  return true;
+}
+
+void TextTemplate::addRenderStats(RenderState* state, long long wrapStartNs) const {
+  TextStats* stats = state->stats;
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  stats->wrapNs += textNowNs() - wrapStartNs;
+  stats->numCCs += ccs.size();
+  for (int i = 0; i < ccs.size(); ++i) {
+    if (ccs[i].words != NULL) {
+      stats->numLinesWrapped += state->blocks[ccs[i].blockIndex].numContentLines;
+    }
+    stats->numWordsPlaced += state->ccs[i].numWordsPlaced;
+    stats->numShareDistributions += state->ccs[i].numShareDistributions;
+  }
+}
+
+void TextTemplate::renderStreaming(RenderState* state, int width, const char** wordSources,
+                                   const LengthFunc* lengthFuncs, int checkpointInterval) const {
+  DSLError error;
+  if (!renderStreaming(state, width, wordSources, lengthFuncs, checkpointInterval, &error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::renderStreaming(RenderState* state, int width, const char** wordSources,
+                                   const LengthFunc* lengthFuncs, int checkpointInterval, DSLError* error) const {
+  if (!bindRender(state, width, wordSources, lengthFuncs, error)) {
+    return false;
+  }
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    if (ccs[i].words != NULL) {
+      TextVector<CCCheckpoint>* checkpoints = (checkpointInterval > 0) ? &state->ccs[i].checkpoints : NULL;
+      state->blocks[ccs[i].blockIndex].numContentLines = ccs[i].countCCLines(*state, &state->ccs[i], checkpointInterval, checkpoints);
+      ccs[i].startStreamingCCLines(*state, &state->ccs[i]);
+    } else {
+      ccs[i].generateCCLines(state, &state->ccs[i]);
+    }
+  }
+  computeLines(state);
+  return true;
+}
+
+void TextTemplate::measure(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs) const {
+  DSLError error;
+  if (!measure(state, width, wordSources, lengthFuncs, &error)) {
+    throw DSLException(error.f_at, error.message);
+  }
+}
+
+bool TextTemplate::measure(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                           DSLError* error) const {
+  if (!bindRender(state, width, wordSources, lengthFuncs, error)) {
+    return false;
+  }
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    const Words* words = ccs[i].words;
+    if (words == NULL) {
+      // One line, whose lengths can only fail to fit if some are '#' lengths
+      if (!ccs[i].childrenConsistent) {
+        ccs[i].generateCCLines(state, &state->ccs[i]);
+      }
+      continue;
+    }
+    const WordLengths* wordLengths = (state->wordLengths != NULL && !words->balanced) ? &state->wordLengths[words->sourceIndex] : NULL;
+    if (wordLengths != NULL && wordLengths->source != NULL && wordSources != NULL &&
+        wordLengths->source == wordSources[words->sourceIndex]) {
+      state->blocks[ccs[i].blockIndex].numContentLines = ccs[i].countCCLines(*state, &state->ccs[i], *wordLengths);
+    } else {
+      state->blocks[ccs[i].blockIndex].numContentLines = ccs[i].countCCLines(*state, &state->ccs[i]);
+    }
+  }
+  root->computeNumContentLines(state);
+  root->computeNumTotalLines(state, root->getNumFixedLines(*state));
+  root->computeBlockVerticalFillersShares(state);
+  state->numCols = state->layout->numCols;
+  state->numTotalLines = state->blocks[0].numTotalLines;
+  return true;
+}
+
+void TextTemplate::streamContentLine(char** bufAt, RenderState* state, int lineNum) const {
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    if (ccs[i].words != NULL) {
+      ccs[i].streamCCLine(*state, lineNum, &state->ccs[i]);
+    }
+    ccs[i].printContentLine(bufAt, *state, state->ccs[i], lineNum);
+  }
+}
+
+void TextTemplate::streamContentLine(char** bufAt, RenderState* state, int lineNum, int colBegin, int colEnd) const {
+  const TextVector<ConsistentContent>& ccs = state->layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    const ConsistentContent& cc = ccs[i];
+    int begin = std::max(cc.startCol, colBegin);
+    int end = std::min(cc.endCol, colEnd);
+    if (begin >= end) {
+      continue;   // not even wrapped
+    }
+    if (cc.words != NULL) {
+      cc.streamCCLine(*state, lineNum, &state->ccs[i]);
+    }
+    if (begin == cc.startCol && end == cc.endCol) {
+      cc.printContentLine(bufAt, *state, state->ccs[i], lineNum);
+    } else {
+      state->scratchChars.resize(cc.endCol - cc.startCol);
+      char* scratchAt = &state->scratchChars[0];
+      cc.printContentLine(&scratchAt, *state, state->ccs[i], lineNum);
+      memcpy(*bufAt, &state->scratchChars[begin - cc.startCol], end - begin);
+      *bufAt += end - begin;
+    }
+  }
+}
+
+void TextTemplate::printContentLine(FILE* stream, const RenderState& state, int lineNum) const {
+  const TextVector<ConsistentContent>& ccs = state.layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    ccs[i].printContentLine(stream, state, state.ccs[i], lineNum);
+  }
+}
+
+void TextTemplate::printContentLine(char** bufAt, const RenderState& state, int lineNum) const {
+  const TextVector<ConsistentContent>& ccs = state.layout->ccs;
+  for (int i = 0; i < ccs.size(); ++i) {
+    ccs[i].printContentLine(bufAt, state, state.ccs[i], lineNum);
+  }
+}
+
+// -------------------------------------------------------------------------------------------------
+
+namespace {
+
+// Most recently used template at the front of lru.
+struct TextTemplateCache {
+  TextTemplateCache() : hits(0), misses(0) {}
+
+  std::mutex mutex;
+  std::list<TextTemplatePtr> lru;
+  std::unordered_map<std::string, std::list<TextTemplatePtr>::iterator> index;
+  unsigned long long hits;
+  unsigned long long misses;
+};
+
+// Built during static initialization, before any thread can render: the toolsets this builds with
+// don't make the initialization of function-local statics thread-safe.
+TextTemplateCache processTemplateCache;
+
+TextTemplateCache& templateCache() {
+  return processTemplateCache;
+}
+
+}
+
+TextTemplatePtr text_template_cache_get(const std::string& format, bool* compiled) {
+  DSLError error;
+  TextTemplatePtr tmpl = text_template_cache_get(format, compiled, &error);
+  if (!tmpl) {
+    throw DSLException(error.f_at, error.message);
+  }
+  return tmpl;
+}
+
+TextTemplatePtr text_template_cache_get(const std::string& format, bool* compiled, DSLError* error) {
+  if (compiled != NULL) {
+    *compiled = false;
+  }
+  TextTemplateCache& cache = templateCache();
+  {
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    auto found = cache.index.find(format);
+    if (found != cache.index.end()) {
+      ++cache.hits;
+      cache.lru.splice(cache.lru.begin(), cache.lru, found->second);
+      return *found->second;
+    }
+    ++cache.misses;
+  }
+
+  // Compile outside of the lock; if another thread compiles the same format concurrently, the first
+  // one to be inserted wins.
+  std::shared_ptr<TextTemplate> tmpl(new TextTemplate(format));
+  DSLError compileError;
+  if (!tmpl->compile(&compileError)) {
+    error->set(format.c_str() + (compileError.f_at - tmpl->format.c_str()), compileError.message);
+    return TextTemplatePtr();
+  }
+
+  if (compiled != NULL) {
+    *compiled = true;
+  }
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  auto found = cache.index.find(format);
+  if (found != cache.index.end()) {
+    return *found->second;
+  }
+  cache.lru.push_front(tmpl);
+  cache.index[format] = cache.lru.begin();
+  if (cache.lru.size() > TEXT_TEMPLATE_CACHE_CAPACITY) {
+    cache.index.erase(cache.lru.back()->format);
+    cache.lru.pop_back();
+  }
+  return tmpl;
+}
+
+TextTemplateCacheStats text_template_cache_stats() {
+  TextTemplateCache& cache = templateCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  TextTemplateCacheStats stats;
+  stats.hits = cache.hits;
+  stats.misses = cache.misses;
+  stats.size = cache.lru.size();
+  return stats;
+}
+
+void text_template_cache_clear() {
+  TextTemplateCache& cache = templateCache();
+  std::lock_guard<std::mutex> lock(cache.mutex);
+  cache.lru.clear();
+  cache.index.clear();
+  cache.hits = 0;
+  cache.misses = 0;
+}
@@ -0,0 +1,122 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include "ast.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <stdio.h>
+
+// A format string parsed once. Word sources and length funcs are bound per render, and so are the
+// width taken by '*' lengths and the length arguments taken by '$' lengths (RenderState::args), so
+// one template can be rendered any number of times at any width and lengths.
+// The width-dependent passes (convertLLSharesToLength, computeStartEndCols, flatten) produce a
+// Layout; a format without '*' or '$' lengths is laid out once by compile(), and the others keep
+// their TEXT_LAYOUT_CACHE_CAPACITY most recently used layouts, so renders at the same width and
+// lengths share one.
+// Once compiled, a template is immutable but for its layout cache: everything a render computes goes
+// into the caller's RenderState, so any number of threads can render the same template concurrently,
+// only locking to find their layout.
+struct TextTemplate {
+  TextTemplate(const std::string& format);  // only copies the format; call compile() to parse it
+
+  void compile();   // throws DSLException
+  // args must have one integer for each '$' length, and may be NULL if there are none.
+  void layout(Layout* layout, int width, const TextArgs* args = NULL) const;   // throws DSLException
+  // The two passes of layout(), apart so they can be timed: lengths ('*', '$' and shares) and
+  // columns, then the flattening into ConsistentContents. Neither marks the layout valid for a render.
+  void layoutLengths(Layout* layout, int width, const TextArgs* args = NULL) const;   // throws DSLException
+  void layoutCCs(Layout* layout) const;                  // throws DSLException
+
+  // The same without throwing: each returns false with *error set at the first error. parse() is
+  // the first half of compile(), which then lays out a format without '*' or '$' lengths.
+  bool parse(DSLError* error);
+  bool compile(DSLError* error);
+  bool layout(Layout* layout, int width, const TextArgs* args, DSLError* error) const;
+  bool layoutLengths(Layout* layout, int width, const TextArgs* args, DSLError* error) const;
+  // width is ignored if the format has no '*' lengths. Throws DSLException.
+  void render(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs) const;
+  // The same, but returning false with *error set if the template can't be laid out at width and
+  // state->args. Errors wrapping the lines still throw DSLException.
+  bool render(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+              DSLError* error) const;
+  void printContentLine(FILE* stream, const RenderState& state, int lineNum) const;
+  void printContentLine(char** bufAt, const RenderState& state, int lineNum) const;
+
+  // Like render(), but the lines of Words are only counted, not kept: streamContentLine then
+  // generates each output line as it is printed, so the state holds one line per CC no matter how
+  // long the word sources are. Lines must be streamed in increasing order, unless checkpointInterval
+  // is positive: then the count also records where the lines of each Words start about every
+  // checkpointInterval lines, and any line can be streamed next, wrapping only from the checkpoint
+  // before it. Both throw DSLException.
+  void renderStreaming(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                       int checkpointInterval = 0) const;
+  bool renderStreaming(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                       int checkpointInterval, DSLError* error) const;   // layout errors as for render()
+  void streamContentLine(char** bufAt, RenderState* state, int lineNum) const;
+  // Only columns [colBegin, colEnd) of the line, which must be within numCols. CCs entirely outside
+  // of them are skipped.
+  void streamContentLine(char** bufAt, RenderState* state, int lineNum, int colBegin, int colEnd) const;
+
+  // Only the line counts of a render: the lines of Words are counted as by renderStreaming, checking
+  // that each line's unused length has a share to go to, and only CCs without Words but with '#'
+  // lengths generate their one line. The state gets each block's line counts, numCols and
+  // numTotalLines but has nothing to print, and measuring fails exactly where rendering would. Greedy
+  // Words are counted from state->wordLengths of their source, if it has been scanned. Throws
+  // DSLException.
+  void measure(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs) const;
+  bool measure(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+               DSLError* error) const;   // layout errors as for render()
+
+  // Returns false with *error set if the template can't be laid out
+  bool bindRender(RenderState* state, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                  DSLError* error) const;
+  // The cached layout for width and args, laid out and cached if there is none (*laidOut then tells
+  // so). Returns an empty pointer with *error set if it can't be laid out; failed layouts aren't cached.
+  std::shared_ptr<const Layout> findLayout(int width, const TextArgs* args, bool* laidOut, DSLError* error) const;
+  void computeLines(RenderState* state) const;  // vertical layout once every CC's line count is known
+  void addRenderStats(RenderState* state, long long wrapStartNs) const;
+
+  unsigned long long id;  // unique per template, so a Layout can tell which template it belongs to
+  std::string format;     // f_at of every node points into this string
+  ASTPtr root;
+  std::vector<const AST*> nodes;  // indexed by AST::nodeIndex
+  const AST* renderWidthNode;     // first node with a '*' length; NULL if there is none
+  Layout fixedLayout;             // the layout of a format without '*' or '$' lengths
+  int numWordSources;
+  int numLengthFuncs;
+  int numArgs;                    // '$' lengths
+  int numBlocks;
+  mutable std::mutex layoutsMutex;
+  mutable std::list<std::shared_ptr<const Layout> > layouts;   // most recently used first
+};
+
+typedef std::shared_ptr<const TextTemplate> TextTemplatePtr;
+
+const int TEXT_LAYOUT_CACHE_CAPACITY = 16;
+
+// -------------------------------------------------------------------------------------------------
+
+struct TextTemplateCacheStats {
+  unsigned long long hits;
+  unsigned long long misses;
+  int size;
+};
+
+const int TEXT_TEMPLATE_CACHE_CAPACITY = 256;
+
+// Returns the template for the given fully-evaluated format string, compiling and caching it on a
+// miss. The cache is process-wide and evicts the least recently used template once it holds
+// TEXT_TEMPLATE_CACHE_CAPACITY templates. Throws DSLException (pointing into format) if the format
+// does not compile; failed formats are not cached. *compiled, if given, tells whether this call
+// compiled the format.
+TextTemplatePtr text_template_cache_get(const std::string& format, bool* compiled = NULL);
+// The same without throwing: returns NULL with *error set (pointing into format) instead.
+TextTemplatePtr text_template_cache_get(const std::string& format, bool* compiled, DSLError* error);
+TextTemplateCacheStats text_template_cache_stats();
+void text_template_cache_clear();   // also resets the hit/miss counters
+
+#endif
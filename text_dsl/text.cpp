@@ -1,11 +1,15 @@
 #include "text.h"
 #include "ast.h"
+#include "template.h"
+#include "arena.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <cstdarg>
 #include <stdexcept>
 #include <cctype>
 #include <assert.h>
+#include <algorithm>
 
 
 int sprintf(std::string* str, const char* format, ...) {
@@ -33,419 +37,1039 @@ int vsprintf(std::string* str, const char* format, va_list args) {
 }
 
 
-static bool isSpace(char c) {
-  return (c == ' ' || c == '\f' || c == '\n' || c == '\r' || c == '\t' || c == '\v');
+static void printFormatError(const char* f_begin, const char* f_at, const char* message) {
+  fprintf(stderr, "%s\n", f_begin);
+  for (int i = 0; i < f_at - f_begin; ++i) {
+    fputc(' ', stderr);
+  }
+  fprintf(stderr, "^\n");
+  fprintf(stderr, "Error at %d: %s\n", f_at - f_begin, message);
+}
+
+static void printDSLException(const char* f_begin, const DSLException& e) {
+  printFormatError(f_begin, e.f_at, e.what());
 }
 
-// Should be called after any token is parsed so that fptr is moved to the start of the next token
-static void parseWhitespaces(const char** fptr) {
-  while (isSpace(**fptr)) {
-    ++*fptr;
+// Errors go to *error if the caller asked for a result code, and are printed otherwise.
+static void reportError(TextError* error, const char* f_begin, const char* f_at, const char* message) {
+  if (error != NULL) {
+    error->at = f_at - f_begin;
+    error->message = message;
+  } else {
+    printFormatError(f_begin, f_at, message);
   }
 }
 
-static int parseUint(const char** fptr) {
-  assert(std::isdigit(**fptr));
-  int value = 0;
-  do {
-    int digit = **fptr - '0';
-    value = value * 10 + digit;
-    ++*fptr;
-  } while (std::isdigit(**fptr));
-  return value;
+static bool renderTemplate(RenderState* state, const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                           TextError* error = NULL) {
+  if (state->stats != NULL) {
+    ++state->stats->numRenders;
+  }
+  DSLError layoutError;
+  try {
+    if (!tmpl.render(state, width, wordSources, lengthFuncs, &layoutError)) {
+      reportError(error, tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+      return false;
+    }
+  } catch (DSLException& e) {
+    reportError(error, tmpl.format.c_str(), e.f_at, e.message);
+    return false;
+  }
+  return true;
 }
 
-// Used for parsing the next char within a quote, surrounded by the specified quote character.
-// Any character can be escaped by a preceding backslash; only the escaped character is returned.
-static char parseCharInsideQuotes(const char** fptr, char quote) {
-  assert(**fptr != quote);
-  char c = **fptr;
-  if (c == '\0') {
-    throw DSLException(*fptr, "Reached end of string; expected char.");
+static TextTemplatePtr generateCCs(RenderState* state, const std::string& evaluatedFormat, const char** wordSources, const LengthFunc* lengthFuncs,
+                                   TextError* error = NULL) {
+  TextStats* stats = state->stats;
+  long long startNs = (stats != NULL) ? textNowNs() : 0;
+  bool compiled;
+  DSLError compileError;
+  TextTemplatePtr tmpl = text_template_cache_get(evaluatedFormat, &compiled, &compileError);
+  if (!tmpl) {
+    reportError(error, evaluatedFormat.c_str(), compileError.f_at, compileError.message);
+    return TextTemplatePtr();
   }
-  ++*fptr;
-  if (c == '\\') {
-    // parse and return the character directly after the backslash.
-    c = **fptr;
-    ++*fptr;
+  if (stats != NULL) {
+    stats->parseNs += textNowNs() - startNs;
+    if (compiled) {
+      stats->numNodesParsed += tmpl->nodes.size();
+      stats->numShareDistributions += tmpl->fixedLayout.numShareDistributions;
+    }
+  }
+  if (!renderTemplate(state, *tmpl, UNKNOWN_COL, wordSources, lengthFuncs, error)) {
+    return TextTemplatePtr();
   }
-  return c;
+  return tmpl;
 }
 
-static char parseCharLiteral(const char** fptr) {  // TOKEN
-  assert(**fptr == '\'');
-  ++*fptr;
-  if (**fptr == '\'') {
-    throw DSLException(*fptr, "Exected char literial; found '' instead.");
+static TextTemplatePtr generateCCs(RenderState* state, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  long long startNs = (state->stats != NULL) ? textNowNs() : 0;
+  std::string evaluatedFormat;
+  int formatLength = vsprintf(&evaluatedFormat, format, args);
+  evaluatedFormat.resize(formatLength);   // drop the '\0' padding so the cache key is just the format
+  if (state->stats != NULL) {
+    state->stats->formatNs += textNowNs() - startNs;
+  }
+  return generateCCs(state, evaluatedFormat, wordSources, lengthFuncs);
+}
+
+static TextTemplatePtr generateCCs(RenderState* state, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args) {
+  long long startNs = (state->stats != NULL) ? textNowNs() : 0;
+  std::string evaluatedFormat;
+  try {
+    format.expand(&evaluatedFormat, args);
+  } catch (DSLException& e) {
+    printDSLException(format.format.c_str(), e);
+    return TextTemplatePtr();
   }
-  char c = parseCharInsideQuotes(&*fptr, '\'');
-  if (**fptr != '\'') {
-    throw DSLException(*fptr, "Expected closing ' for char literal.");
+  if (state->stats != NULL) {
+    state->stats->formatNs += textNowNs() - startNs;
   }
-  ++*fptr;
-  parseWhitespaces(fptr);
-  return c;
+  return generateCCs(state, evaluatedFormat, wordSources, lengthFuncs);
 }
 
-static FillerPtr parseStringLiteral(const char** fptr) { // TOKEN
-  assert(**fptr == '\'');
-  const char* f_at = *fptr;
-  ++*fptr;
-  std::string str;
-  while (**fptr != '\'') {
-    str += parseCharInsideQuotes(&*fptr, '\'');
+static TextTemplatePtr generateCCs(RenderState* state, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args,
+                                   TextError* error = NULL) {
+  state->args = &args;
+  return generateCCs(state, std::string(format), wordSources, lengthFuncs, error);
+}
+
+// The resource a render state allocates from: upstream itself, or upstream behind a counter when
+// there are stats to add the render's memory to. Declared before the RenderState, so the counts are
+// added once the state is gone.
+struct RenderMemory {
+  RenderMemory(TextMemoryResource* upstream, TextStats* stats) : counter(upstream), stats(stats) {}
+  ~RenderMemory() {
+    if (stats != NULL) {
+      stats->numAllocations += counter.numAllocations;
+      stats->bytesAllocated += counter.bytesAllocated;
+      stats->peakLiveBytes = std::max(stats->peakLiveBytes, counter.peakLiveBytes);
+    }
   }
-  ++*fptr;
-  parseWhitespaces(fptr);
-  return FillerPtr(new StringLiteral(f_at, str));
+  TextMemoryResource* resource() { return (stats != NULL) ? &counter : counter.upstream; }
+
+  TextCountingResource counter;
+  TextStats* stats;
+};
+
+// Phase time and size of the output, for the writeRendered functions
+static void addOutputStats(const RenderState& state, long long startNs, long long numBytes) {
+  state.stats->outputNs += textNowNs() - startNs;
+  state.stats->numBytesEmitted += numBytes;
 }
 
-static LiteralLength parseLiteralLength(const char** fptr) {
-  assert(std::isdigit(**fptr));
-  LiteralLength ll(parseUint(fptr), false);
-  if (**fptr == 's') {
-    ll.shares = true;
-    ++*fptr;
+// Lines are assembled in a buffer and written WRITE_BATCH_SIZE bytes (at least one line) at a
+// time, so a stream gets one fwrite per batch instead of a call per piece of each line.
+static const int WRITE_BATCH_SIZE = 64 * 1024;
+
+static void writeRendered(FILE* stream, const TextTemplate& tmpl, const RenderState& state) {
+  long long startNs = (state.stats != NULL) ? textNowNs() : 0;
+  long long numBytes = 0;
+  int lineSize = state.numCols + 1;   // with the '\n' before it
+  int linesPerBatch = std::max(1, WRITE_BATCH_SIZE / lineSize);
+  TextString batch(TextAllocator<char>(state.resource));
+  batch.resize(std::min(linesPerBatch, state.numTotalLines) * lineSize);
+  int lineNum = 0;
+  while (lineNum < state.numTotalLines) {
+    char* bufAt = &batch[0];
+    int batchEnd = std::min(lineNum + linesPerBatch, state.numTotalLines);
+    for (; lineNum < batchEnd; ++lineNum) {
+      if (lineNum > 0) {
+        *bufAt = '\n';
+        ++bufAt;
+      }
+      tmpl.printContentLine(&bufAt, state, lineNum);
+    }
+    fwrite(&batch[0], 1, bufAt - &batch[0], stream);
+    numBytes += bufAt - &batch[0];
+  }
+  if (state.stats != NULL) {
+    addOutputStats(state, startNs, numBytes);
   }
-  parseWhitespaces(fptr);
-  return ll;
 }
 
-static FunctionLength parseFunctionLength(const char** fptr, const LengthFunc** lengthFuncsPtr) {
-  assert(**fptr == '#');
-  FunctionLength fl(**lengthFuncsPtr, false);
-  ++*lengthFuncsPtr;
-  ++*fptr;
-  if (**fptr == 's') {
-    fl.shares = true;
-    ++*fptr;
+// Every line of the output has a known place, so with a pool the lines are written in parallel, in
+// chunks of about PARALLEL_CHUNK_SIZE bytes.
+static const int PARALLEL_CHUNK_SIZE = 64 * 1024;
+
+// Calls writeLines(beginLine, endLine) to cover all lines of the output.
+template <typename WriteLines>
+static void forEachLineChunk(const RenderState& state, WriteLines writeLines) {
+  if (state.pool == NULL) {
+    writeLines(0, state.numTotalLines);
+    return;
   }
-  parseWhitespaces(fptr);
-  return fl;
+  int linesPerChunk = std::max(1, PARALLEL_CHUNK_SIZE / (state.numCols + 1));
+  int numChunks = (state.numTotalLines + linesPerChunk - 1) / linesPerChunk;
+  state.pool->parallelFor(numChunks, [&](int chunk) {
+    int beginLine = chunk * linesPerChunk;
+    writeLines(beginLine, std::min(beginLine + linesPerChunk, state.numTotalLines));
+  });
 }
 
-// Parses 0 or more fillers
-static void parseFillers(const char** fptr, std::vector<FillerPtr>* fillers) {
-  while (**fptr == '\'' || std::isdigit(**fptr)) {
-    FillerPtr filler;
-    if (**fptr == '\'') {
-      filler = parseStringLiteral(fptr);
-    } else {
-      const char* f_at = *fptr;
-      LiteralLength length = parseLiteralLength(fptr);
-      if (**fptr == '\'') {
-        char c = parseCharLiteral(fptr);
-        filler.reset(new RepeatedCharLL(f_at, length, c));
-      } else {
-        throw DSLException(*fptr, "Expected char literal after literal length.");
+static void writeRendered(std::string* str, const TextTemplate& tmpl, const RenderState& state) {
+  long long startNs = (state.stats != NULL) ? textNowNs() : 0;
+  size_t lineSize = state.numCols + 1;   // with the '\n' before it
+  str->resize(lineSize * state.numTotalLines - 1);
+  char* out = &str->front();
+  forEachLineChunk(state, [&](int beginLine, int endLine) {
+    for (int lineNum = beginLine; lineNum < endLine; ++lineNum) {
+      char* bufAt = out + lineSize * lineNum;
+      if (lineNum > 0) {
+        bufAt[-1] = '\n';
       }
+      tmpl.printContentLine(&bufAt, state, lineNum);
     }
-    fillers->push_back(std::move(filler));
+  });
+  if (state.stats != NULL) {
+    addOutputStats(state, startNs, str->size());
   }
 }
 
-static ASTPtr parseRepeatedCharFL(const char** fptr, const LengthFunc** lengthFuncsPtr) {
-  assert(**fptr == '#');
-  const char* f_at = *fptr;
-  ASTPtr ast;
-  FunctionLength length = parseFunctionLength(fptr, lengthFuncsPtr);
-  if (**fptr == '\'') {
-    char c = parseCharLiteral(fptr);
-    ast.reset(new RepeatedCharFL(f_at, length, c));
-  } else {
-    throw DSLException(*fptr, "Expected char literal after function length.");
+// Writes one string per line, starting at lines[firstLine].
+static void writeRendered(std::vector<std::string>* lines, int firstLine, const TextTemplate& tmpl, const RenderState& state) {
+  long long startNs = (state.stats != NULL) ? textNowNs() : 0;
+  lines->resize(firstLine + state.numTotalLines);
+  std::string* out = lines->data() + firstLine;
+  forEachLineChunk(state, [&](int beginLine, int endLine) {
+    for (int lineNum = beginLine; lineNum < endLine; ++lineNum) {
+      std::string& line = out[lineNum];
+      line.resize(state.numCols);
+      char* bufAt = &line.front();
+      tmpl.printContentLine(&bufAt, state, lineNum);
+    }
+  });
+  if (state.stats != NULL) {
+    addOutputStats(state, startNs, (long long)state.numCols * state.numTotalLines);
   }
-  return ast;
 }
 
-static char parseSilhouetteCharLiteral(const char** fptr) {
-  assert(**fptr == '-');
-  ++*fptr;
-  if (**fptr != '>') {
-    throw DSLException(*fptr, "Expected > immediately after -.");
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+static void text_printf_va(TextStats* stats, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stdout, *tmpl, state);
   }
-  ++*fptr;
-  parseWhitespaces(fptr); // -> is a token
-  if (**fptr != '\'') {
-    throw DSLException(*fptr, "Expected char literal after ->.");
+}
+
+void text_printf(const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_printf_va(NULL, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+void text_printf(TextStats* stats, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_printf_va(stats, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+static void text_fprintf_va(TextStats* stats, FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stream, *tmpl, state);
   }
-  return parseCharLiteral(fptr);
 }
 
-static ASTPtr parseWords(const char** fptr, const char*** wordSourcesPtr) {
-  assert(**fptr == '{');
-  Words* words = new Words(*fptr, **wordSourcesPtr);
-  ++*wordSourcesPtr;
-  ASTPtr ast(words);
-  ++*fptr;
-  parseWhitespaces(fptr); // { is a token
-  if (**fptr == 'w') {
-    ++*fptr;
-    parseWhitespaces(fptr); // w is a token
-    if (**fptr == '-') {
-      words->wordSilhouette = parseSilhouetteCharLiteral(fptr);
-    }
-    parseFillers(fptr, &words->interwordFillers);
-  } else {
-    throw DSLException(*fptr, "Expected w after {.");
+void text_fprintf(FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_fprintf_va(NULL, stream, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+void text_fprintf(TextStats* stats, FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_fprintf_va(stats, stream, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+static void text_sprintf_va(TextStats* stats, std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(str, *tmpl, state);
   }
-  if (**fptr != '}') {
-    throw DSLException(*fptr, "Expected }, ->, or interword fillers.");
+}
+
+void text_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_va(NULL, str, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+void text_sprintf(TextStats* stats, std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_va(stats, str, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+static void text_sprintf_lines_va(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, 0, *tmpl, state);
   }
-  ++*fptr;
-  parseWhitespaces(fptr); // } is a token
-  return ast;
 }
 
-static void parseTopOrBottomFiller(const char** fptr, std::vector<FillerPtr>* fillers, bool top) {
-  char firstChar = top ? '^' : 'v';
-  assert(**fptr == firstChar);
-  ++*fptr;
-  parseWhitespaces(fptr); // ^, v are tokens
-  if (**fptr != '{') {
-    throw DSLException(*fptr, "Expected {.");
+void text_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_lines_va(NULL, lines, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+void text_sprintf_lines(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_lines_va(stats, lines, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+static void text_sprintf_lines_append_va(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, va_list args) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, lines->size(), *tmpl, state);
   }
-  ++*fptr;
-  parseWhitespaces(fptr); // { is a token
-  parseFillers(fptr, fillers);
-  if (**fptr != '}') {
-    throw DSLException(*fptr, "Expected }.");
+}
+
+void text_sprintf_lines_append(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_lines_append_va(NULL, lines, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+void text_sprintf_lines_append(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
+  va_list args;
+  va_start(args, lengthFuncs);
+  text_sprintf_lines_append_va(stats, lines, format, wordSources, lengthFuncs, args);
+  va_end(args);
+}
+
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+void text_printf(const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stdout, *tmpl, state);
   }
-  ++*fptr;
-  parseWhitespaces(fptr); // } is a token
 }
 
+void text_fprintf(FILE* stream, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stream, *tmpl, state);
+  }
+}
 
-static ASTPtr parseSpecifiedLengthContent(const char** fptr, const char*** wordSourcesPtr, const LengthFunc** lengthFuncsPtr) {
-  assert(**fptr == '\'' || std::isdigit(**fptr) || **fptr == '#');
-  ASTPtr slc;
-  if (**fptr == '\'') {
-    slc = parseStringLiteral(fptr);
-  } else if (**fptr == '#') {
-    slc = parseRepeatedCharFL(fptr, lengthFuncsPtr);
-  } else {
-    const char* f_at = *fptr;
-    LiteralLength length = parseLiteralLength(fptr);
-    if (**fptr == '\'') {
-      slc.reset(new RepeatedCharLL(f_at, length, parseCharLiteral(fptr)));
-    } else if (**fptr == '[') {
-      Block* block = new Block(f_at, length);
-      slc.reset(block);
-      ++*fptr;
-      parseWhitespaces(fptr); // [ is a token
-      while (**fptr != ']') {
-        if (**fptr == '\'' || std::isdigit(**fptr) || **fptr == '#') {
-          block->addChild(parseSpecifiedLengthContent(fptr, wordSourcesPtr, lengthFuncsPtr));
-        } else if (**fptr == '{') {
-          block->addWords(parseWords(fptr, wordSourcesPtr));
-        } else {
-          throw DSLException(*fptr, "Expected ', digit, or # to begin specified-length content, "
-            "or { to begin greedy-length content.");
-        }
-      }
-      ++*fptr;
-      parseWhitespaces(fptr); // ] is a token
-      if (**fptr == '^') {
-        parseTopOrBottomFiller(fptr, &block->topFillers, true);
-        if (**fptr == 'v') {
-          parseTopOrBottomFiller(fptr, &block->bottomFillers, false);
-        }
-      } else if (**fptr == 'v') {
-        parseTopOrBottomFiller(fptr, &block->bottomFillers, false);
-        if (**fptr == '^') {
-          parseTopOrBottomFiller(fptr, &block->topFillers, true);
-        }
-      }
-    } else {
-      throw DSLException(*fptr, "Expected ' or [ after length specifier.");
-    }
+void text_sprintf(std::string* str, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(str, *tmpl, state);
   }
-  return slc;
 }
 
-static ASTPtr parseFormat(const char** fptr, const char*** wordSourcesPtr, const LengthFunc** lengthFuncsPtr) {
-  parseWhitespaces(fptr);
-  // Will insert all root content as children into a super-root Block.
-  Block* rootsParentBlock = new Block(*fptr, LiteralLength(0, false));
-  ASTPtr rootsParent(rootsParentBlock);
-  while (**fptr != '\0') {
-    if (**fptr == '\'' || std::isdigit(**fptr)) {
-      ASTPtr root = parseSpecifiedLengthContent(fptr, wordSourcesPtr, lengthFuncsPtr);
-      int rootLength = root->getFixedLength();
-      if (rootLength == UNKNOWN_COL) {
-        throw DSLException(root->f_at, "Root content must be fixed-length.");
-      }
-      rootsParentBlock->addChild(std::move(root));
-      rootsParentBlock->length.value += rootLength;
-    } else {
-      throw DSLException(*fptr, "Expected ' or digit.");
-    }
+void text_sprintf_lines(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, 0, *tmpl, state);
   }
-  return rootsParent;
 }
 
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, lines->size(), *tmpl, state);
+  }
+}
 
-static ASTPtr generateCCs(std::vector<ConsistentContent>* ccs, const char* format, const char*** wordSourcesPtr, const LengthFunc** lengthFuncsPtr, va_list args) {
-  ccs->clear();
-  std::string evaluatedFormat;
-  vsprintf(&evaluatedFormat, format, args);
-  const char* f_begin = evaluatedFormat.c_str();
-  const char* f_at = f_begin;
-  ASTPtr root;
-  try {
-    //printf("\n\n%s\n", format);
+//----------------------------------------------------------------------------------------------------------------------------------------------------
 
-    root = parseFormat(&f_at, wordSourcesPtr, lengthFuncsPtr);
-    root->convertLLSharesToLength();
-    root->computeStartEndCols(0, root->getFixedLength());
+void text_printf(const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stdout, *tmpl, state);
+  }
+}
 
-    std::vector<FillerPtr> topFillersStack, bottomFillersStack;
-    root->flatten(root, root, ccs, true, &topFillersStack, &bottomFillersStack);
-    //root->print();
-    //printf("\n");
+void text_fprintf(FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(stream, *tmpl, state);
+  }
+}
 
-    for (ConsistentContent& cc : *ccs) {
-      cc.generateCCLines();
-    }
+void text_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(str, *tmpl, state);
+  }
+}
 
-    root->computeNumContentLines();
-    root->computeNumTotalLines(true);
-    root->computeBlockVerticalFillersShares();
-
-    //printf("\n");
-    for (ConsistentContent& cc : *ccs) {
-      /*printf("\n");
-      cc.print();
-      printf("\n");
-      printf("content: %d  fixed: %d  total: %d\n", cc.srcAst->numContentLines, cc.srcAst->numFixedLines, cc.srcAst->numTotalLines);*/
-      cc.generateLinesChars(root->numTotalLines);
-    }
-    //printf("\n\n");
+void text_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, 0, *tmpl, state);
+  }
+}
+
+void text_sprintf_lines_append(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args);
+  if (tmpl) {
+    writeRendered(lines, lines->size(), *tmpl, state);
+  }
+}
 
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+TextTemplatePtr text_template(const char* format) {
+  std::string formatStr(format);  // errors point into the string the template was compiled from
+  try {
+    return text_template_cache_get(formatStr);
   } catch (DSLException& e) {
-    fprintf(stderr, "%s\n", f_begin);
-    for (int i = 0; i < e.f_at - f_begin; ++i) {
-      fputc(' ', stderr);
-    }
-    fprintf(stderr, "^\n");
-    fprintf(stderr, "Error at %d: %s\n", e.f_at - f_begin, e.what());
-    
-    return ASTPtr();
+    printDSLException(formatStr.c_str(), e);
+    return TextTemplatePtr();
+  }
+}
+
+void text_printf(const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                 TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (renderTemplate(&state, tmpl, width, wordSources, lengthFuncs)) {
+    writeRendered(stdout, tmpl, state);
+  }
+}
+
+void text_fprintf(FILE* stream, const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                  TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (renderTemplate(&state, tmpl, width, wordSources, lengthFuncs)) {
+    writeRendered(stream, tmpl, state);
+  }
+}
+
+void text_sprintf(std::string* str, const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                  TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (renderTemplate(&state, tmpl, width, wordSources, lengthFuncs)) {
+    writeRendered(str, tmpl, state);
   }
+}
 
-  return root;
+void text_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                        TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (renderTemplate(&state, tmpl, width, wordSources, lengthFuncs)) {
+    writeRendered(lines, 0, tmpl, state);
+  }
+}
+
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                               TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (renderTemplate(&state, tmpl, width, wordSources, lengthFuncs)) {
+    writeRendered(lines, lines->size(), tmpl, state);
+  }
 }
 
 //----------------------------------------------------------------------------------------------------------------------------------------------------
 
-void text_printf(const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
-  va_list args;
-  va_start(args, lengthFuncs);
-  std::vector<ConsistentContent> ccs;
-  ASTPtr root = generateCCs(&ccs, format, &wordSources, &lengthFuncs, args);
-  va_end(args);
-  if (!root) {
-    return;
+void text_printf(const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources,
+                 TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  state.lengthSources = &lengthSources;
+  if (renderTemplate(&state, tmpl, width, wordSources, NULL)) {
+    writeRendered(stdout, tmpl, state);
   }
+}
 
-  for (ConsistentContent& cc : ccs) {
-    cc.printContentLine(stdout, 0, root->numTotalLines);
+void text_fprintf(FILE* stream, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources,
+                  TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  state.lengthSources = &lengthSources;
+  if (renderTemplate(&state, tmpl, width, wordSources, NULL)) {
+    writeRendered(stream, tmpl, state);
   }
-  for (int i = 1; i < root->numTotalLines; ++i) {
-    printf("\n");
-    for (ConsistentContent& cc : ccs) {
-      cc.printContentLine(stdout, i, root->numTotalLines);
-    }
+}
+
+void text_sprintf(std::string* str, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources,
+                  TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  state.lengthSources = &lengthSources;
+  if (renderTemplate(&state, tmpl, width, wordSources, NULL)) {
+    writeRendered(str, tmpl, state);
   }
 }
 
-void text_fprintf(FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
-  va_list args;
-  va_start(args, lengthFuncs);  
-  std::vector<ConsistentContent> ccs;
-  ASTPtr root = generateCCs(&ccs, format, &wordSources, &lengthFuncs, args);
-  va_end(args);
-  if (!root) {
-    return;
+void text_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources,
+                        TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  state.lengthSources = &lengthSources;
+  if (renderTemplate(&state, tmpl, width, wordSources, NULL)) {
+    writeRendered(lines, 0, tmpl, state);
+  }
+}
+
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources,
+                               TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  state.lengthSources = &lengthSources;
+  if (renderTemplate(&state, tmpl, width, wordSources, NULL)) {
+    writeRendered(lines, lines->size(), tmpl, state);
+  }
+}
+
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+// The result-code functions report to a TextError of their own if the caller passes none, since
+// reportError would print to stderr.
+
+bool text_validate(const char* format, int width, TextError* error, const TextArgs* args) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextTemplate tmpl(format);
+  DSLError parseError;
+  if (!tmpl.parse(&parseError)) {
+    reportError(error, tmpl.format.c_str(), parseError.f_at, parseError.message);
+    return false;
+  }
+  if ((tmpl.renderWidthNode != NULL && width < 0) || (tmpl.numArgs > 0 && args == NULL)) {
+    return true;  // the lengths aren't known, so only the syntax can be checked
+  }
+  TextArena arena;
+  Layout layout(&arena);
+  DSLError layoutError;
+  if (!tmpl.layoutLengths(&layout, width, args, &layoutError)) {
+    reportError(error, tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+    return false;
+  }
+  return true;
+}
+
+TextTemplatePtr text_template(const char* format, TextError* error) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  std::string formatStr(format);
+  DSLError compileError;
+  TextTemplatePtr tmpl = text_template_cache_get(formatStr, NULL, &compileError);
+  if (!tmpl) {
+    reportError(error, formatStr.c_str(), compileError.f_at, compileError.message);
+  }
+  return tmpl;
+}
+
+bool text_try_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args,
+                      TextError* error, TextStats* stats) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args, error);
+  if (!tmpl) {
+    return false;
+  }
+  writeRendered(str, *tmpl, state);
+  return true;
+}
+
+bool text_try_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs,
+                            const TextArgs& args, TextError* error, TextStats* stats) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderMemory memory(&arena, stats);
+  RenderState state(memory.resource());
+  state.stats = stats;
+  TextTemplatePtr tmpl = generateCCs(&state, format, wordSources, lengthFuncs, args, error);
+  if (!tmpl) {
+    return false;
+  }
+  writeRendered(lines, 0, *tmpl, state);
+  return true;
+}
+
+bool text_try_sprintf(std::string* str, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources,
+                      const LengthFunc* lengthFuncs, TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (!renderTemplate(&state, tmpl, width, wordSources, lengthFuncs, error)) {
+    return false;
+  }
+  writeRendered(str, tmpl, state);
+  return true;
+}
+
+bool text_try_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources,
+                            const LengthFunc* lengthFuncs, TextMemoryResource* resource, TextThreadPool* pool, TextStats* stats) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderMemory memory(resource != NULL ? resource : &arena, stats);
+  RenderState state(memory.resource(), pool);
+  state.stats = stats;
+  if (!renderTemplate(&state, tmpl, width, wordSources, lengthFuncs, error)) {
+    return false;
   }
+  writeRendered(lines, 0, tmpl, state);
+  return true;
+}
 
-  for (ConsistentContent& cc : ccs) {
-    cc.printContentLine(stream, 0, root->numTotalLines);
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+static bool measureTemplate(RenderState* state, TextMeasure* measure, const TextTemplate& tmpl, int width, const char** wordSources,
+                            const LengthFunc* lengthFuncs, TextError* error) {
+  DSLError layoutError;
+  try {
+    if (!tmpl.measure(state, width, wordSources, lengthFuncs, &layoutError)) {
+      reportError(error, tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+      return false;
+    }
+  } catch (DSLException& e) {
+    reportError(error, tmpl.format.c_str(), e.f_at, e.message);
+    return false;
   }
-  for (int i = 1; i < root->numTotalLines; ++i) {
-    fprintf(stream, "\n");
-    for (ConsistentContent& cc : ccs) {
-      cc.printContentLine(stream, i, root->numTotalLines);
+  measure->numLines = state->numTotalLines;
+  measure->numCols = state->numCols;
+  measure->numContentLines.resize(tmpl.numBlocks);
+  measure->numTotalLines.resize(tmpl.numBlocks);
+  measure->startCols.resize(tmpl.numBlocks);
+  measure->endCols.resize(tmpl.numBlocks);
+  for (const AST* node : tmpl.nodes) {
+    if (node->type == BLOCK) {
+      int i = static_cast<const Block*>(node)->blockIndex;
+      const NodeLayout& nodeLayout = state->layout->nodes[node->nodeIndex];
+      measure->numContentLines[i] = state->blocks[i].numContentLines;
+      measure->numTotalLines[i] = state->blocks[i].numTotalLines;
+      measure->startCols[i] = nodeLayout.startCol;
+      measure->endCols[i] = nodeLayout.endCol;
     }
   }
+  return true;
 }
 
-void text_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
-  va_list args;
-  va_start(args, lengthFuncs);
-  std::vector<ConsistentContent> ccs;
-  ASTPtr root = generateCCs(&ccs, format, &wordSources, &lengthFuncs, args);
-  va_end(args);
-  if (!root) {
+bool text_measure(TextMeasure* measure, const char* format, int width, TextError* error, const char** wordSources,
+                  const LengthFunc* lengthFuncs, const TextArgs* args) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  std::string formatStr(format);
+  DSLError compileError;
+  TextTemplatePtr tmpl = text_template_cache_get(formatStr, NULL, &compileError);
+  if (!tmpl) {
+    reportError(error, formatStr.c_str(), compileError.f_at, compileError.message);
+    return false;
+  }
+  TextArena arena;
+  RenderState state(&arena);
+  state.args = args;
+  return measureTemplate(&state, measure, *tmpl, width, wordSources, lengthFuncs, error);
+}
+
+bool text_measure(TextMeasure* measure, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources,
+                  const LengthFunc* lengthFuncs, TextMemoryResource* resource) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderState state(resource != NULL ? resource : &arena);
+  return measureTemplate(&state, measure, tmpl, width, wordSources, lengthFuncs, error);
+}
+
+bool text_measure(TextMeasure* measure, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources,
+                  const TextLengthSources& lengthSources, TextMemoryResource* resource) {
+  TextError unused;
+  error = (error != NULL) ? error : &unused;
+  TextArena arena;
+  RenderState state(resource != NULL ? resource : &arena);
+  state.lengthSources = &lengthSources;
+  return measureTemplate(&state, measure, tmpl, width, wordSources, NULL, error);
+}
+
+// The sources of balanced Words are left unscanned, as those are wrapped from the source, and so
+// are missing sources, which measuring then reports.
+static void scanWordSources(const TextTemplate& tmpl, const char** wordSources, TextVector<WordLengths>* wordLengths) {
+  wordLengths->resize(tmpl.numWordSources, WordLengths(wordLengths->get_allocator().resource));
+  if (wordSources == NULL) {
     return;
   }
+  for (const AST* node : tmpl.nodes) {
+    if (node->type == WORDS && !static_cast<const Words*>(node)->balanced) {
+      int sourceIndex = static_cast<const Words*>(node)->sourceIndex;
+      WordLengths& lengths = (*wordLengths)[sourceIndex];
+      if (wordSources[sourceIndex] != NULL && lengths.source != wordSources[sourceIndex]) {
+        lengths.scan(wordSources[sourceIndex]);
+      }
+    }
+  }
+}
+
+TextWidthSolver::TextWidthSolver(const TextTemplate& tmpl, const char** wordSources, const LengthFunc* lengthFuncs,
+                                 TextMemoryResource* resource)
+  : tmpl(tmpl), wordSources(wordSources), lengthFuncs(lengthFuncs), state(resource != NULL ? resource : &arena),
+  wordLengths(TextAllocator<WordLengths>(state.resource)), numProbes(0) {
+  scanWordSources(tmpl, wordSources, &wordLengths);
+  state.wordLengths = wordLengths.data();
+}
+
+TextWidthSolver::TextWidthSolver(const TextTemplate& tmpl, const char** wordSources, const TextLengthSources& lengthSources,
+                                 TextMemoryResource* resource)
+  : tmpl(tmpl), wordSources(wordSources), lengthFuncs(NULL), state(resource != NULL ? resource : &arena),
+  wordLengths(TextAllocator<WordLengths>(state.resource)), numProbes(0) {
+  scanWordSources(tmpl, wordSources, &wordLengths);
+  state.wordLengths = wordLengths.data();
+  state.lengthSources = &lengthSources;
+}
 
-  int rootNumCols = root->endCol - root->startCol;
-  str->resize((rootNumCols + 1) * root->numTotalLines - 1);
-  char* bufAt = &str->front();
-  for (ConsistentContent& cc : ccs) {
-    cc.printContentLine(&bufAt, 0, root->numTotalLines);
+int TextWidthSolver::numLines(int width, TextError* error) {
+  ++numProbes;
+  DSLError layoutError;
+  try {
+    if (!tmpl.measure(&state, width, wordSources, lengthFuncs, &layoutError)) {
+      reportError(error, tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+      return -1;
+    }
+  } catch (DSLException& e) {
+    reportError(error, tmpl.format.c_str(), e.f_at, e.message);
+    return -1;
+  }
+  return state.numTotalLines;
+}
+
+bool TextWidthSolver::measure(TextMeasure* measure, int width) {
+  ++numProbes;
+  return measureTemplate(&state, measure, tmpl, width, wordSources, lengthFuncs, &error);
+}
+
+// Both searches start at maxWidth, the one width whose error is reported, then keep lo failing and
+// hi meeting the goal (or the reverse for fillWidth), so each width is measured at most once.
+
+bool TextWidthSolver::fitWidth(TextFit* fit, int maxLines, int minWidth, int maxWidth) {
+  fit->width = UNKNOWN_COL;
+  fit->numLines = numLines(maxWidth, &error);
+  if (fit->numLines < 0) {
+    return false;
+  } else if (fit->numLines > maxLines) {
+    return true;
   }
-  for (int i = 1; i < root->numTotalLines; ++i) {
-    *bufAt = '\n';
-    ++bufAt;
-    for (ConsistentContent& cc : ccs) {
-      cc.printContentLine(&bufAt, i, root->numTotalLines);
+  int lo = std::min(minWidth, maxWidth) - 1;
+  int hi = maxWidth;
+  int hiNumLines = fit->numLines;
+  TextError narrowError;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    int midNumLines = numLines(mid, &narrowError);
+    if (midNumLines >= 0 && midNumLines <= maxLines) {
+      hi = mid;
+      hiNumLines = midNumLines;
+    } else {
+      lo = mid;
     }
-  }  
+  }
+  fit->width = hi;
+  fit->numLines = hiNumLines;
+  return true;
 }
 
-void text_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
-  va_list args;
-  va_start(args, lengthFuncs);
-  std::vector<ConsistentContent> ccs;
-  ASTPtr root = generateCCs(&ccs, format, &wordSources, &lengthFuncs, args);
-  va_end(args);
-  if (!root) {
-    return;
+bool TextWidthSolver::fillWidth(TextFit* fit, int minLines, int minWidth, int maxWidth) {
+  fit->width = UNKNOWN_COL;
+  fit->numLines = numLines(maxWidth, &error);
+  if (fit->numLines < 0) {
+    return false;
+  } else if (fit->numLines >= minLines) {
+    fit->width = maxWidth;
+    return true;
   }
+  int lo = std::min(minWidth, maxWidth) - 1;
+  int loNumLines = -1;
+  int hi = maxWidth;
+  TextError narrowError;
+  while (hi - lo > 1) {
+    int mid = lo + (hi - lo) / 2;
+    int midNumLines = numLines(mid, &narrowError);
+    if (midNumLines < 0 || midNumLines >= minLines) {
+      lo = mid;
+      loNumLines = midNumLines;
+    } else {
+      hi = mid;
+      fit->numLines = midNumLines;
+    }
+  }
+  if (loNumLines >= 0) {
+    fit->width = lo;
+    fit->numLines = loNumLines;
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------------------------------------
 
-  int rootNumCols = root->endCol - root->startCol;
-  lines->resize(root->numTotalLines);
-  for (int lineNum = 0; lineNum < root->numTotalLines; ++lineNum) {
-    std::string& line = lines->at(lineNum);
-    line.resize(rootNumCols);
-    char* bufAt = &line.front();
-    for (int i = 0; i < ccs.size(); ++i) {
-      ccs[i].printContentLine(&bufAt, lineNum, root->numTotalLines);
+bool text_sprintf_batch(std::string* str, const TextTemplate& tmpl, const TextRecord* records, int numRecords,
+                        std::vector<size_t>* recordOffsets, TextThreadPool* pool, TextStats* stats) {
+  int numChunks = (numRecords + TEXT_BATCH_CHUNK_SIZE - 1) / TEXT_BATCH_CHUNK_SIZE;
+  std::vector<std::string> chunks(numChunks);
+  std::vector<TextStats> chunkStats((stats != NULL) ? numChunks : 0);   // merged once the chunks are done
+  std::vector<size_t> offsets(numRecords + 1);    // within the record's chunk until the chunks are joined
+  std::vector<char> chunkFailed(numChunks, false);
+  auto renderChunk = [&](int chunk) {
+    int recordsBegin = chunk * TEXT_BATCH_CHUNK_SIZE;
+    int recordsEnd = std::min(recordsBegin + TEXT_BATCH_CHUNK_SIZE, numRecords);
+    std::string& out = chunks[chunk];
+    RenderMemory memory(NULL, (stats != NULL) ? &chunkStats[chunk] : NULL);
+    RenderState state(memory.resource());
+    state.stats = memory.stats;
+    for (int i = recordsBegin; i < recordsEnd; ++i) {
+      offsets[i] = out.size();
+      const TextRecord& record = records[i];
+      state.lengthSources = record.lengthSources;
+      if (!renderTemplate(&state, tmpl, record.width, record.wordSources, record.lengthFuncs)) {
+        chunkFailed[chunk] = true;
+        continue;
+      }
+      long long startNs = (state.stats != NULL) ? textNowNs() : 0;
+      size_t lineSize = state.numCols + 1;
+      size_t at = out.size();
+      out.resize(at + lineSize * state.numTotalLines);
+      char* bufAt = &out[0] + at;
+      for (int lineNum = 0; lineNum < state.numTotalLines; ++lineNum) {
+        tmpl.printContentLine(&bufAt, state, lineNum);
+        *bufAt = '\n';
+        ++bufAt;
+      }
+      if (state.stats != NULL) {
+        addOutputStats(state, startNs, lineSize * state.numTotalLines);
+      }
+    }
+  };
+  if (pool != NULL) {
+    pool->parallelFor(numChunks, renderChunk);
+  } else {
+    for (int chunk = 0; chunk < numChunks; ++chunk) {
+      renderChunk(chunk);
+    }
+  }
+
+  // Join the chunks: every chunk's place in the output is known once they are all rendered
+  std::vector<size_t> chunkOffsets(numChunks + 1, 0);
+  for (int chunk = 0; chunk < numChunks; ++chunk) {
+    chunkOffsets[chunk + 1] = chunkOffsets[chunk] + chunks[chunk].size();
+  }
+  str->resize(chunkOffsets[numChunks]);
+  auto copyChunk = [&](int chunk) {
+    if (!chunks[chunk].empty()) {
+      memcpy(&(*str)[0] + chunkOffsets[chunk], chunks[chunk].data(), chunks[chunk].size());
+    }
+    int recordsBegin = chunk * TEXT_BATCH_CHUNK_SIZE;
+    int recordsEnd = std::min(recordsBegin + TEXT_BATCH_CHUNK_SIZE, numRecords);
+    for (int i = recordsBegin; i < recordsEnd; ++i) {
+      offsets[i] += chunkOffsets[chunk];
+    }
+  };
+  if (pool != NULL) {
+    pool->parallelFor(numChunks, copyChunk);
+  } else {
+    for (int chunk = 0; chunk < numChunks; ++chunk) {
+      copyChunk(chunk);
     }
   }
+  offsets[numRecords] = str->size();
+  for (const TextStats& s : chunkStats) {
+    stats->add(s);
+  }
+  if (recordOffsets != NULL) {
+    recordOffsets->swap(offsets);
+  }
+  return std::find(chunkFailed.begin(), chunkFailed.end(), (char)true) == chunkFailed.end();
 }
 
-void text_sprintf_lines_append(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, ...) {
-  va_list args;
-  va_start(args, lengthFuncs);
-  std::vector<ConsistentContent> ccs;
-  ASTPtr root = generateCCs(&ccs, format, &wordSources, &lengthFuncs, args);
-  va_end(args);
-  if (!root) {
-    return;
+//----------------------------------------------------------------------------------------------------------------------------------------------------
+
+TextLineStream::TextLineStream(const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                               TextMemoryResource* resource)
+  : tmpl(tmpl), state(resource != NULL ? resource : &arena), lineNum(0), failed(false) {
+  DSLError layoutError;
+  try {
+    if (!tmpl.renderStreaming(&state, width, wordSources, lengthFuncs, 0, &layoutError)) {
+      printFormatError(tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+      failed = true;
+    }
+  } catch (DSLException& e) {
+    printDSLException(tmpl.format.c_str(), e);
+    failed = true;
+  }
+}
+
+bool TextLineStream::next(std::string* line) {
+  if (failed || lineNum >= state.numTotalLines) {
+    return false;
+  }
+  line->resize(state.numCols);
+  char* bufAt = &line->front();
+  try {
+    tmpl.streamContentLine(&bufAt, &state, lineNum);
+  } catch (DSLException& e) {
+    printDSLException(tmpl.format.c_str(), e);
+    failed = true;
+    return false;
   }
+  ++lineNum;
+  return true;
+}
+
+bool text_stream(const TextTemplate& tmpl, int width, TextLineSink sink, void* context, const char** wordSources, const LengthFunc* lengthFuncs,
+                 TextMemoryResource* resource) {
+  TextLineStream stream(tmpl, width, wordSources, lengthFuncs, resource);
+  std::string line;
+  while (stream.next(&line)) {
+    sink(line.data(), line.length(), context);
+  }
+  return !stream.failed;
+}
 
-  int rootNumCols = root->endCol - root->startCol;
-  lines->reserve(lines->size() + root->numTotalLines);
-  for (int lineNum = 0; lineNum < root->numTotalLines; ++lineNum) {
-    lines->push_back(std::string());
-    std::string& line = lines->back();
-    line.resize(rootNumCols);
-    char* bufAt = &line.front();
-    for (int i = 0; i < ccs.size(); ++i) {
-      ccs[i].printContentLine(&bufAt, lineNum, root->numTotalLines);
+// ---
+
+TextViewport::TextViewport(const TextTemplate& tmpl, int width, const char** wordSources, const LengthFunc* lengthFuncs,
+                           TextMemoryResource* resource, int checkpointInterval)
+  : tmpl(tmpl), state(resource != NULL ? resource : &arena), failed(false) {
+  DSLError layoutError;
+  try {
+    if (!tmpl.renderStreaming(&state, width, wordSources, lengthFuncs, std::max(1, checkpointInterval), &layoutError)) {
+      printFormatError(tmpl.format.c_str(), layoutError.f_at, layoutError.message);
+      failed = true;
     }
+  } catch (DSLException& e) {
+    printDSLException(tmpl.format.c_str(), e);
+    failed = true;
+  }
+}
+
+bool TextViewport::render(std::vector<std::string>* lines, int rowBegin, int rowEnd, int colBegin, int colEnd) {
+  lines->clear();
+  if (failed) {
+    return false;
+  }
+  rowBegin = std::max(rowBegin, 0);
+  rowEnd = std::min(rowEnd, state.numTotalLines);
+  colBegin = std::max(colBegin, 0);
+  colEnd = std::min(colEnd, state.numCols);
+  if (rowBegin >= rowEnd) {
+    return true;
+  }
+  int numCols = std::max(colEnd - colBegin, 0);
+  lines->resize(rowEnd - rowBegin);
+  if (numCols == 0) {
+    return true;
+  }
+  try {
+    for (int lineNum = rowBegin; lineNum < rowEnd; ++lineNum) {
+      std::string& line = (*lines)[lineNum - rowBegin];
+      line.resize(numCols);
+      char* bufAt = &line[0];
+      tmpl.streamContentLine(&bufAt, &state, lineNum, colBegin, colEnd);
+    }
+  } catch (DSLException& e) {
+    printDSLException(tmpl.format.c_str(), e);
+    failed = true;
+    lines->clear();
+    return false;
   }
+  return true;
 }
@@ -2,8 +2,15 @@
 #define DSL_H
 
 #include "ast.h"
+#include "template.h"
+#include "arena.h"
+#include "threadpool.h"
+#include "mapfile.h"
+#include "format.h"
+#include "stats.h"
 
 #include <stdio.h>
+#include <limits.h>
 #include <string>
 #include <vector>
 
@@ -16,4 +23,287 @@ void text_sprintf(std::string* str, const char* format, const char** wordSources
 void text_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
 void text_sprintf_lines_append(std::vector<std::string>* lines, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
 
+// Every text_* call can add its counts and phase times to a TextStats (see stats.h). Calls with a
+// format take it first, since their trailing arguments are the format's; template calls take it last.
+
+void text_printf(TextStats* stats, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
+void text_fprintf(TextStats* stats, FILE* stream, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
+void text_sprintf(TextStats* stats, std::string* str, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
+void text_sprintf_lines(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
+void text_sprintf_lines_append(TextStats* stats, std::vector<std::string>* lines, const char* format, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, ...);
+
+// Typed arguments: the same as above, but each argument must convert to a TextArg, and the format's
+// conversions, parsed once by TextFormat, are checked against the arguments before anything is
+// formatted. A mismatch is printed like a format error. Expanded formats go through the template
+// cache, so a call that repeats the arguments of an earlier one only lays out and renders, e.g.
+//   static const TextFormat format("%d[{w' '}1s' ']");
+//   text_sprintf(&str, format, wordSources, NULL, width);
+
+void text_printf(const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_fprintf(FILE* stream, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf(std::string* str, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf_lines(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+
+template <typename... Args>
+void text_printf(const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_printf(format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)));
+}
+
+template <typename... Args>
+void text_fprintf(FILE* stream, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_fprintf(stream, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)));
+}
+
+template <typename... Args>
+void text_sprintf(std::string* str, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf(str, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)));
+}
+
+template <typename... Args>
+void text_sprintf_lines(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf_lines(lines, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)));
+}
+
+template <typename... Args>
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf_lines_append(lines, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)));
+}
+
+template <typename... Args>
+void text_printf(TextStats* stats, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_printf(format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)), stats);
+}
+
+template <typename... Args>
+void text_fprintf(TextStats* stats, FILE* stream, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_fprintf(stream, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)), stats);
+}
+
+template <typename... Args>
+void text_sprintf(TextStats* stats, std::string* str, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf(str, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)), stats);
+}
+
+template <typename... Args>
+void text_sprintf_lines(TextStats* stats, std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf_lines(lines, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)), stats);
+}
+
+template <typename... Args>
+void text_sprintf_lines_append(TextStats* stats, std::vector<std::string>* lines, const TextFormat& format, const char** wordSources, const LengthFunc* lengthFuncs, const Args&... args) {
+  const TextArg argArray[] = { TextArg(args)..., TextArg() };
+  text_sprintf_lines_append(lines, format, wordSources, lengthFuncs, TextArgs(argArray, sizeof...(Args)), stats);
+}
+
+// Length arguments: '$' in place of a literal length ("$", "$s") takes the next integer of args, in
+// order of appearance, when the format is laid out. The format is not run through printf, so it is
+// cached as written and each call only binds its lengths, e.g.
+//   const TextArg lengths[] = { nameWidth, valueWidth };
+//   text_sprintf(&str, "$[{w' '}1s' '] $[{w' '}1s' ']", wordSources, NULL, TextArgs(lengths, 2));
+// A missing, negative or non-integer argument is printed like a format error.
+
+void text_printf(const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_fprintf(FILE* stream, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+void text_sprintf_lines_append(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextStats* stats=NULL);
+
+// Compiles a format once so it can be rendered at any width: the format may use '*' as the length of
+// root content, which then takes the width passed to each render (e.g. "*[{w' '}]"). The format is
+// not run through printf. Prints the error and returns NULL if the format does not compile.
+TextTemplatePtr text_template(const char* format);
+
+// Result codes: the functions below neither print errors nor let them escape as exceptions. On an
+// error they return false (or NULL) and, if error is not NULL, set it to where in the format the
+// error is, as an offset, and what it is, as a static string.
+struct TextError {
+  TextError() : at(-1), message(NULL) {}
+
+  int at;
+  const char* message;
+};
+
+// Checks a format as text_template would compile it, then that its lengths and shares fit at width
+// with args taken by its '$' lengths, without flattening it into CCs or wrapping any words. Syntax
+// errors are found without throwing; the lengths aren't checked if the format has '*' lengths and
+// width is negative, or '$' lengths and args is NULL. Errors that depend on the word sources or the
+// length funcs, like a line with no length left for words, are only found by rendering.
+bool text_validate(const char* format, int width, TextError* error=NULL, const TextArgs* args=NULL);
+
+TextTemplatePtr text_template(const char* format, TextError* error);
+
+// As text_sprintf and text_sprintf_lines with length arguments, and with a template
+bool text_try_sprintf(std::string* str, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextError* error, TextStats* stats=NULL);
+bool text_try_sprintf_lines(std::vector<std::string>* lines, const char* format, const char** wordSources, const LengthFunc* lengthFuncs, const TextArgs& args, TextError* error, TextStats* stats=NULL);
+bool text_try_sprintf(std::string* str, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+bool text_try_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+
+// Measuring: the size of the output at width, found by counting the lines of each Words without
+// generating the output, e.g. to size a view or paginate before rendering. Each block of the format
+// gets its number of content lines (lines of words, or the most lines of any child), its number of
+// lines with its vertical fillers, and its columns, UNKNOWN_COL if they depend on the line ('#'
+// lengths). Blocks are in order of appearance in the format, after the root, which holds it all.
+// Measuring fails, with the same error, exactly where rendering would, e.g. at a width where a line
+// of words leaves length that no share-length content can take.
+struct TextMeasure {
+  TextMeasure() : numLines(0), numCols(0) {}
+
+  int numLines;
+  int numCols;
+  std::vector<int> numContentLines;   // indexed by block
+  std::vector<int> numTotalLines;
+  std::vector<int> startCols;
+  std::vector<int> endCols;
+};
+
+// The format is compiled as by text_template, and width and args are used as by text_validate.
+bool text_measure(TextMeasure* measure, const char* format, int width, TextError* error=NULL, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, const TextArgs* args=NULL);
+bool text_measure(TextMeasure* measure, const TextTemplate& tmpl, int width, TextError* error=NULL, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL);
+bool text_measure(TextMeasure* measure, const TextTemplate& tmpl, int width, TextError* error, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL);
+
+// Fitting: the narrowest width in [minWidth, maxWidth] at which the output takes at most maxLines
+// lines, e.g. to size a pane to its content, or the reverse, the widest at which it still takes at
+// least minLines. A solver scans the source of each greedy Words into a table of word lengths once,
+// and each width it tries is only measured, as by text_measure, by wrapping those lengths. Widths are
+// binary searched, which assumes the output takes no more lines at a greater width: that holds for
+// greedy Words, but balanced Words, measured from their source at each width, can take more, so the
+// width found for them fits but may not be the narrowest (or widest) that does. Measuring fails
+// exactly where rendering would, and a width that fails counts as taking more lines than any other,
+// so the width found always renders, in its numLines lines. Widths that fail among widths that
+// don't, as where some lines of words have no share-length content to fill them, break the
+// assumption too: the search may then miss a width that would do. The template, the word sources,
+// the length sources and the resource must outlive the solver.
+struct TextFit {
+  TextFit() : width(UNKNOWN_COL), numLines(0) {}
+
+  int width;      // UNKNOWN_COL if no width in the range fits
+  int numLines;   // at width; if no width fits, at the width that came closest
+};
+
+struct TextWidthSolver {
+  TextWidthSolver(const TextTemplate& tmpl, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL,
+                  TextMemoryResource* resource=NULL);
+  TextWidthSolver(const TextTemplate& tmpl, const char** wordSources, const TextLengthSources& lengthSources,
+                  TextMemoryResource* resource=NULL);
+  // Each returns false with error set if the template fails to render at maxWidth, and true
+  // otherwise, with fit->width UNKNOWN_COL if no width in the range fits.
+  bool fitWidth(TextFit* fit, int maxLines, int minWidth, int maxWidth);
+  bool fillWidth(TextFit* fit, int minLines, int minWidth, int maxWidth);
+  bool measure(TextMeasure* measure, int width);   // as text_measure, setting error
+  int numLines(int width, TextError* error);       // -1 on error, with *error set
+
+  const TextTemplate& tmpl;
+  const char** wordSources;
+  const LengthFunc* lengthFuncs;
+  TextArena arena;
+  RenderState state;
+  TextVector<WordLengths> wordLengths;   // indexed by word source; only those of greedy Words are scanned
+  int numProbes;    // widths measured so far
+  TextError error;
+};
+
+// The render state of a template render takes its memory from resource, or from a TextArena on the
+// stack if resource is NULL, and is freed all at once when the call returns. The output is not
+// allocated from resource. With a pool, the columns (the word sources of different blocks) are
+// wrapped in parallel on its threads, and text_sprintf and text_sprintf_lines also write the lines of
+// the output in parallel; the output is the same as without.
+
+void text_printf(const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_fprintf(FILE* stream, const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf(std::string* str, const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+
+// Length sources: the same, but the '#' lengths come from TextLengthSources (see ast.h), which can
+// carry a context pointer, fill many lines per call or be precomputed arrays, e.g.
+//   const TextLengthSource sources[] = { TextLengthSource(&indentLengths, &document),
+//                                        TextLengthSource(marginLengths, numMarginLengths) };
+//   text_sprintf(&str, *tmpl, width, wordSources, TextLengthSources(sources, 2));
+
+void text_printf(const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_fprintf(FILE* stream, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf(std::string* str, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf_lines(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+void text_sprintf_lines_append(std::vector<std::string>* lines, const TextTemplate& tmpl, int width, const char** wordSources, const TextLengthSources& lengthSources, TextMemoryResource* resource=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+
+// Batch: renders the template once per record, each with its own word sources, length funcs (or
+// length sources, if not NULL) and width, and writes the lines of all of them to *str in record
+// order, each line followed by '\n'. Records are rendered in chunks of TEXT_BATCH_CHUNK_SIZE, on the
+// pool's threads if there is one; each chunk reuses one render state, so a run of records at the
+// same width is laid out only once.
+// If recordOffsets is not NULL, it gets numRecords + 1 offsets into *str: record i's lines are
+// [(*recordOffsets)[i], (*recordOffsets)[i + 1]). A record that fails to render is printed as by the
+// other text_* functions and has no lines; the return value is false if any record failed.
+struct TextRecord {
+  const char** wordSources;
+  const LengthFunc* lengthFuncs;
+  int width;
+  const TextLengthSources* lengthSources;
+};
+
+const int TEXT_BATCH_CHUNK_SIZE = 256;
+
+bool text_sprintf_batch(std::string* str, const TextTemplate& tmpl, const TextRecord* records, int numRecords,
+                        std::vector<size_t>* recordOffsets=NULL, TextThreadPool* pool=NULL, TextStats* stats=NULL);
+
+// Streaming renders generate each line of the output only when it is needed and keep just the
+// current line of each column, so memory use depends on the number of columns rather than the
+// number of lines. '#' lengths likewise only keep the TEXT_LENGTH_FILL_LINES lines around the current
+// line. The line counts are still found up front by a scan of the word sources that allocates
+// nothing. The lines, joined with '\n', are exactly what text_sprintf produces; errors are printed
+// as by the other text_* functions and end the stream.
+
+// Pull-style: each call to next() produces the next line (without '\n'). The template, the word
+// sources and the resource must outlive the stream; if resource is NULL, the stream has its own arena.
+struct TextLineStream {
+  TextLineStream(const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL,
+                 TextMemoryResource* resource=NULL);
+  bool next(std::string* line);   // false once all lines have been produced, or on error
+  int numLines() const { return failed ? 0 : state.numTotalLines; }
+
+  const TextTemplate& tmpl;
+  TextArena arena;
+  RenderState state;
+  int lineNum;
+  bool failed;
+};
+
+// Push-style: calls sink with each line (without '\n') as soon as it is generated; the line is only
+// valid during the call. Returns false on error.
+typedef void(*TextLineSink)(const char* line, int length, void* context);
+bool text_stream(const TextTemplate& tmpl, int width, TextLineSink sink, void* context, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL, TextMemoryResource* resource=NULL);
+
+// Random access: a window of rows and columns of the output, e.g. for scrolling a view of a long
+// document. Construction counts the lines like a stream and also indexes where the words of each
+// column start about every checkpointInterval lines; each row of a window is then wrapped from the
+// checkpoint before it, so a window costs about (rowEnd - rowBegin + checkpointInterval) lines of
+// wrapping however deep it is. Columns of the template that fall outside [colBegin, colEnd) are not
+// wrapped at all. Rows and columns are clamped to the output; the rows produced are exactly those
+// lines of text_sprintf, cut to the columns. Errors are printed and make render() return false.
+const int TEXT_CHECKPOINT_INTERVAL = 256;
+
+struct TextViewport {
+  TextViewport(const TextTemplate& tmpl, int width, const char** wordSources=NULL, const LengthFunc* lengthFuncs=NULL,
+               TextMemoryResource* resource=NULL, int checkpointInterval=TEXT_CHECKPOINT_INTERVAL);
+  // Replaces *lines with rows [rowBegin, rowEnd), cut to columns [colBegin, colEnd)
+  bool render(std::vector<std::string>* lines, int rowBegin, int rowEnd, int colBegin=0, int colEnd=INT_MAX);
+  int numLines() const { return failed ? 0 : state.numTotalLines; }
+  int numCols() const { return failed ? 0 : state.numCols; }
+
+  const TextTemplate& tmpl;
+  TextArena arena;
+  RenderState state;
+  bool failed;
+};
+
 #endif
@@ -0,0 +1,118 @@
+#include "threadpool.h"
+
+#include <limits.h>
+#include <algorithm>
+
+TextThreadPool::TextThreadPool(int numThreads)
+  : generation(0), numBusyWorkers(0), stopping(false), task(NULL), errorIndex(INT_MAX) {
+  if (numThreads <= 0) {
+    numThreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  ranges.reset(new Range[numThreads]);
+  for (int i = 0; i < numThreads; ++i) {
+    ranges[i].next = 0;
+    ranges[i].end = 0;
+  }
+  for (int i = 1; i < numThreads; ++i) {
+    workers.push_back(std::thread(&TextThreadPool::workerMain, this, i));
+  }
+}
+
+TextThreadPool::~TextThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void TextThreadPool::workerMain(int participant) {
+  unsigned long long seenGeneration = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!stopping && generation == seenGeneration) {
+        wake.wait(lock);
+      }
+      if (stopping) {
+        return;
+      }
+      seenGeneration = generation;
+    }
+    runTasks(participant);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --numBusyWorkers;
+    }
+    done.notify_one();
+  }
+}
+
+// Own range first, then the others' in turn. Owner and thieves both take indices from the front of
+// a range, one at a time.
+void TextThreadPool::runTasks(int participant) {
+  int numParticipants = numThreads();
+  for (int k = 0; k < numParticipants; ++k) {
+    Range& range = ranges[(participant + k) % numParticipants];
+    for (;;) {
+      int i = range.next.fetch_add(1);
+      if (i >= range.end) {
+        break;
+      }
+      try {
+        (*task)(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (i < errorIndex) {
+          errorIndex = i;
+          error = std::current_exception();
+        }
+      }
+    }
+  }
+}
+
+void TextThreadPool::parallelFor(int n, const std::function<void(int)>& task) {
+  if (n <= 0) {
+    return;
+  }
+  if (workers.empty() || n == 1) {
+    for (int i = 0; i < n; ++i) {
+      task(i);
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> runLock(runMutex);
+  int numParticipants = numThreads();
+  for (int p = 0; p < numParticipants; ++p) {
+    ranges[p].next = (int)((long long)n * p / numParticipants);
+    ranges[p].end = (int)((long long)n * (p + 1) / numParticipants);
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    this->task = &task;
+    errorIndex = INT_MAX;
+    error = std::exception_ptr();
+    numBusyWorkers = (int)workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+  runTasks(0);
+
+  std::exception_ptr firstError;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (numBusyWorkers > 0) {
+      done.wait(lock);
+    }
+    this->task = NULL;
+    firstError = error;
+    error = std::exception_ptr();
+  }
+  if (firstError) {
+    std::rethrow_exception(firstError);
+  }
+}
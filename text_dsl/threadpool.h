@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads for splitting one render's work. parallelFor gives each thread
+// (workers and the caller) a contiguous part of the index range, and a thread that finishes its
+// part steals the remaining indices of the others, so uneven tasks still keep every thread busy.
+// Results must be written by index, which keeps the output independent of scheduling.
+struct TextThreadPool {
+  explicit TextThreadPool(int numThreads = 0);   // 0: one thread per core; includes the caller
+  ~TextThreadPool();
+
+  int numThreads() const { return (int)workers.size() + 1; }
+
+  // Calls task(i) for every i in [0, n) and returns once all calls have returned. If any calls
+  // throw, the exception of the lowest i is rethrown. One parallelFor runs at a time per pool; it
+  // must not be called from within a task.
+  void parallelFor(int n, const std::function<void(int)>& task);
+
+private:
+  struct Range {
+    std::atomic<int> next;
+    int end;
+  };
+
+  void workerMain(int participant);
+  void runTasks(int participant);
+
+  std::vector<std::thread> workers;
+  std::unique_ptr<Range[]> ranges;  // one per thread; the caller's is ranges[0]
+
+  std::mutex runMutex;    // held for the whole of a parallelFor
+  std::mutex mutex;       // guards the fields below
+  std::condition_variable wake;
+  std::condition_variable done;
+  unsigned long long generation;  // incremented for each parallelFor
+  int numBusyWorkers;
+  bool stopping;
+  const std::function<void(int)>* task;
+  int errorIndex;
+  std::exception_ptr error;
+
+  TextThreadPool(const TextThreadPool&);
+  TextThreadPool& operator=(const TextThreadPool&);
+};
+
+#endif
@@ -4,6 +4,29 @@
 #include <vector>
 
 
+void NodeIndexVisitor::addNode(AST* node) {
+  node->nodeIndex = nodes.size();
+  nodes.push_back(node);
+}
+
+void NodeIndexVisitor::visit(StringLiteral* sl) {
+  addNode(sl);
+}
+void NodeIndexVisitor::visit(RepeatedCharLL* rcll) {
+  addNode(rcll);
+}
+void NodeIndexVisitor::visit(RepeatedCharFL* rcfl) {
+  addNode(rcfl);
+}
+void NodeIndexVisitor::visit(Words* w) {
+  addNode(w);
+}
+void NodeIndexVisitor::visit(Block* b) {
+  addNode(b);
+  b->blockIndex = numBlocks;
+  ++numBlocks;
+}
+
 /*ComputeConsistentPosVisitor::ComputeConsistentPosVisitor()
   : startColHint(UNKNOWN_COL), numColsHint(UNKNOWN_COL) {}
 
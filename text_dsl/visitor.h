@@ -1,6 +1,10 @@
 #ifndef VISITOR_H
 #define VISITOR_H
 
+#include <vector>
+
+struct AST;
+
 class StringLiteral;
 class RepeatedCharLL;
 class RepeatedCharFL;
@@ -16,6 +20,24 @@ public:
   virtual void visit(Block* b) = 0;
 };
 
+// Numbers every node in visiting order, and every block separately. Node numbers index the
+// NodeLayouts of a Layout; block numbers index the BlockStates of a RenderState.
+class NodeIndexVisitor : public Visitor {
+public:
+  NodeIndexVisitor() : numBlocks(0) {}
+  void visit(StringLiteral* sl) override;
+  void visit(RepeatedCharLL* rcll) override;
+  void visit(RepeatedCharFL* rcfl) override;
+  void visit(Words* w) override;
+  void visit(Block* b) override;
+
+  std::vector<const AST*> nodes;  // indexed by node number
+  int numBlocks;
+
+private:
+  void addNode(AST* node);
+};
+
 /*class ComputeConsistentPosVisitor : public Visitor {
 public:
   ComputeConsistentPosVisitor();